@@ -0,0 +1,331 @@
+/*
+ * Netris -- A free networked version of T*tris
+ * Copyright (C) 1994-2016  Mark H. Weaver et al
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include "netris.h"
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <string.h>
+#include <stdlib.h>
+#include <curses.h>
+#include <term.h>
+
+/*
+ * A backend (see render.c) that talks ANSI escape codes straight to the
+ * terminal, for "netris -A".  It keeps two copies of the screen: what
+ * the game has drawn, and what the terminal is showing.  A present
+ * works out the changes, skipping over what's the same and grouping
+ * cells of one color so the attributes are only set once a run, and
+ * sends them in a single write().  Over a slow link the bytes and
+ * the system calls per frame are what count.
+ *
+ * Terminfo is only asked whether there are colors; everything else is
+ * assumed to be ANSI, which every terminal anyone uses is.
+ */
+
+#define ANSI_ROWS		64
+#define ANSI_COLS		160
+#define ANSI_OUT		65536
+#define GAP_REWRITE		4		/* Rewrite a gap this narrow, don't move */
+
+/* Cell attributes: a block type for the color, and these */
+#define ATTR_COLOR		0x0f
+#define ATTR_REVERSE	0x10
+
+typedef struct _Cell {
+	char ch;
+	unsigned char attr;
+} Cell;
+
+static Cell want[ANSI_ROWS][ANSI_COLS];		/* What's been drawn */
+static Cell shown[ANSI_ROWS][ANSI_COLS];	/* What the terminal shows */
+static int screenRows = 24, screenCols = 80;
+static int useColor, redrawAll;
+static int curY, curX, curAttr;				/* The terminal's, -1 unknown */
+static struct termios savedTermios;
+static int haveTermios;
+
+static char out[ANSI_OUT];
+static int outLen;
+
+/* The one write() of a frame; only a huge redraw needs more */
+static void Flush(void)
+{
+	int done = 0, n;
+
+	while (done < outLen) {
+		if ((n = write(STDOUT_FILENO, out + done, outLen - done)) <= 0)
+			break;
+		done += n;
+	}
+	outLen = 0;
+}
+
+static void Put(char *s, int len)
+{
+	if (outLen + len > ANSI_OUT)
+		Flush();
+	memcpy(out + outLen, s, len);
+	outLen += len;
+}
+
+static void PutStr(char *s)
+{
+	Put(s, strlen(s));
+}
+
+/* Black on the block's color, as curses.c does, or just standout */
+static void SetAttr(int attr)
+{
+	static char colorNum[] = { 0, 7, 4, 5, 6, 3, 2, 1 };
+	char buf[16];
+	int color = attr & ATTR_COLOR, curColor = curAttr & ATTR_COLOR;
+
+	if (attr == curAttr)
+		return;
+	if (!useColor || !color)
+		strcpy(buf, color && !(attr & ATTR_REVERSE) ? "\033[0;7m" : "\033[m");
+	else if (curAttr >= 0 && curColor
+			&& (curAttr & ATTR_REVERSE) == (attr & ATTR_REVERSE))
+		sprintf(buf, "\033[4%dm", colorNum[color]);	/* Just the color */
+	else
+		sprintf(buf, "\033[0;30;4%d%sm", colorNum[color],
+			attr & ATTR_REVERSE ? ";7" : "");
+	PutStr(buf);
+	curAttr = attr;
+}
+
+/* A relative move along one axis; returns its length */
+static int Relative(char *s, int n, char back, char forw)
+{
+	if (!n)
+		return 0;
+	if (n == 1 || n == -1)
+		return sprintf(s, "\033[%c", n < 0 ? back : forw);
+	return sprintf(s, "\033[%d%c", n < 0 ? -n : n, n < 0 ? back : forw);
+}
+
+/* Whichever's shorter: there absolutely, or from where the cursor is */
+static void MoveTo(int y, int x)
+{
+	char absMove[32], relMove[32];
+	int absLen, relLen;
+
+	if (y == curY && x == curX)
+		return;
+	absLen = sprintf(absMove, "\033[%d;%dH", y + 1, x + 1);
+	if (curY >= 0) {
+		relLen = Relative(relMove, y - curY, 'A', 'B');
+		if (x == 0 && curX > 0)
+			relMove[relLen++] = '\r';
+		else
+			relLen += Relative(relMove + relLen, x - curX, 'D', 'C');
+		if (relLen < absLen)
+			Put(relMove, relLen);
+		else
+			Put(absMove, absLen);
+	}
+	else
+		Put(absMove, absLen);
+	curY = y;
+	curX = x;
+}
+
+static int SameCell(Cell *a, Cell *b)
+{
+	return a->ch == b->ch && a->attr == b->attr;
+}
+
+static int BlankCell(Cell *c)
+{
+	return c->ch == ' ' && !c->attr;
+}
+
+/* Send whatever's changed in row y */
+static void DiffRow(int y)
+{
+	Cell *w = want[y], *s = shown[y];
+	int x, end, blankFrom, gap;
+
+	for (end = screenCols; end > 0 && SameCell(&w[end - 1], &s[end - 1]);
+			--end)
+		;
+	if (!end)
+		return;
+	for (blankFrom = screenCols; blankFrom > 0 && BlankCell(&w[blankFrom - 1]);
+			--blankFrom)
+		;
+	for (x = 0; x < end && x < blankFrom; ++x) {
+		if (SameCell(&w[x], &s[x]))
+			continue;
+		if (curY == y && x > curX && x - curX <= GAP_REWRITE) {
+			for (gap = curX; gap < x && w[gap].attr == curAttr; ++gap)
+				;
+			if (gap == x) {
+				for (gap = curX; gap < x; ++gap)
+					Put(&w[gap].ch, 1);
+				curX = x;
+			}
+		}
+		MoveTo(y, x);
+		SetAttr(w[x].attr);
+		Put(&w[x].ch, 1);
+		s[x] = w[x];
+		++curX;
+	}
+	/* The rest is blank, and something there isn't yet */
+	if (end > blankFrom) {
+		for (x = blankFrom; SameCell(&w[x], &s[x]); ++x)
+			;
+		MoveTo(y, x);
+		SetAttr(0);
+		PutStr("\033[K");
+		for (; x < screenCols; ++x)
+			s[x] = w[x];
+	}
+	/* A terminal at the right margin may or may not have wrapped */
+	if (curX >= screenCols)
+		curY = curX = -1;
+}
+
+static void Clear(Cell rows[ANSI_ROWS][ANSI_COLS])
+{
+	int y, x;
+
+	for (y = 0; y < ANSI_ROWS; ++y)
+		for (x = 0; x < ANSI_COLS; ++x) {
+			rows[y][x].ch = ' ';
+			rows[y][x].attr = 0;
+		}
+}
+
+static void AnsiInit(void)
+{
+	struct termios t;
+	struct winsize size;
+	int err;
+
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_row > 0) {
+		screenRows = size.ws_row < ANSI_ROWS ? size.ws_row : ANSI_ROWS;
+		screenCols = size.ws_col < ANSI_COLS ? size.ws_col : ANSI_COLS;
+	}
+	useColor = colorEnable && setupterm(NULL, STDOUT_FILENO, &err) == OK
+		&& tigetnum("colors") >= 8;
+
+	/* cbreak() and noecho() */
+	if (tcgetattr(STDIN_FILENO, &savedTermios) == 0) {
+		haveTermios = 1;
+		t = savedTermios;
+		t.c_lflag &= ~(ICANON | ECHO);
+		t.c_cc[VMIN] = 1;
+		t.c_cc[VTIME] = 0;
+		tcsetattr(STDIN_FILENO, TCSADRAIN, &t);
+	}
+	Clear(want);
+	redrawAll = 1;
+	PutStr("\033[?1049h\033[?25l");
+}
+
+static void AnsiCleanup(void)
+{
+	curAttr = -1;
+	SetAttr(0);
+	PutStr("\033[?25h\033[?1049l");
+	Flush();
+	if (haveTermios)
+		tcsetattr(STDIN_FILENO, TCSADRAIN, &savedTermios);
+}
+
+static void AnsiText(int y, int x, char *s, int eol)
+{
+	if (y < 0 || y >= screenRows)
+		return;
+	for (; *s && x < screenCols; ++x, ++s) {
+		want[y][x].ch = *s;
+		want[y][x].attr = 0;
+	}
+	if (eol)
+		for (; x < screenCols; ++x) {
+			want[y][x].ch = ' ';
+			want[y][x].attr = 0;
+		}
+}
+
+static void AnsiBlock(int y, int x, BlockType type)
+{
+	char *s = type == BT_none ? "  " : type > 0 ? "[]" : "$$";
+	int i;
+
+	if (y < 0 || y >= screenRows)
+		return;
+	for (i = 0; i < 2 && x + i < screenCols; ++i) {
+		want[y][x + i].ch = s[i];
+		want[y][x + i].attr = standoutEnable ? abs(type) : 0;
+	}
+}
+
+static void AnsiInvert(int y, int x, int width)
+{
+	int i;
+
+	if (y < 0 || y >= screenRows)
+		return;
+	for (i = 0; i < width && x + i < screenCols; ++i)
+		if (want[y][x + i].attr)
+			want[y][x + i].attr |= ATTR_REVERSE;
+}
+
+/* The cursor is hidden, so it's left where the changes ended */
+static void AnsiPresent(int y, int x)
+{
+	int row;
+
+	if (redrawAll) {
+		curAttr = -1;
+		SetAttr(0);
+		PutStr("\033[H\033[2J");
+		curY = curX = 0;
+		Clear(shown);
+		redrawAll = 0;
+	}
+	for (row = 0; row < screenRows; ++row)
+		DiffRow(row);
+	Flush();
+}
+
+static void AnsiRedraw(void)
+{
+	redrawAll = 1;
+}
+
+static RenderBackend ansiBackend = {
+	AnsiInit, AnsiCleanup, AnsiText, AnsiBlock, AnsiInvert,
+	AnsiPresent, AnsiRedraw };
+
+ExtFunc RenderBackend *AnsiBackend(void)
+{
+	return &ansiBackend;
+}
+
+/*
+ * vi: ts=4 ai
+ * vim: noai si
+ */
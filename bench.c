@@ -0,0 +1,426 @@
+/*
+ * Netris -- A free networked version of T*tris
+ * Copyright (C) 1994-2016  Mark H. Weaver et al
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * netris-bench: microbenchmarks for the rules engine and the sample
+ * robot ("make bench").  Every benchmark works on the same corpus of
+ * board positions, built from fixed seeds, so numbers from different
+ * builds can be compared.
+ *
+ * Some operations change the board for good (clearing lines, adding
+ * junk), so those benchmarks restore a saved board before each op.
+ * Their "net" column has the cost of the benchmark named as their
+ * base, the restore on its own, taken away.
+ */
+
+#include "netris.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CORPUS_SIZE		16
+
+typedef struct _Bench {
+	char *name;
+	char *base;				/* Benchmark whose time is overhead, or NULL */
+	long (*run)(long ops);	/* Returns a checksum, so nothing is elided */
+	double median, best;
+} Bench;
+
+static Board corpus[CORPUS_SIZE];		/* Each with a falling piece */
+static Board fullLines[CORPUS_SIZE];	/* ...and some full lines */
+static Board work;
+static signed char views[CORPUS_SIZE][MAX_BOARD_HEIGHT][MAX_BOARD_WIDTH];
+static Shape *allShapes[32];
+static int numShapes;
+static int numRuns = 5, runMsec = 200;
+
+static void NullBoard(Board *b)
+{
+}
+
+static void NullRowUpdate(Board *b, int y, BlockType *row)
+{
+}
+
+static void NullPlotBlock(Board *b, int y, int x, BlockType type)
+{
+}
+
+static void NullPlotUnderline(Board *b, int x, int flag)
+{
+}
+
+static BoardObserver nullObserver = {
+	NullBoard, NullBoard, NullRowUpdate,
+	NullPlotBlock, NullPlotUnderline, NullBoard };
+
+static int Pile(Board *b)
+{
+	int y;
+
+	for (y = b->visible - 1; y >= 0; --y)
+		if (b->rows[b->rowMap[y]])
+			return y + 1;
+	return 0;
+}
+
+/*
+ * Drop random pieces in random places, up to about height.  The legacy
+ * generator keeps the corpus the same as older builds had.
+ */
+static void BuildPosition(Board *b, int seed, int height)
+{
+	RandStream r;
+	int i, y;
+
+	SeedStream(&r, seed, 1);
+	InitBoard(b, NULL, -1);
+	while (Pile(b) < height && Pile(b) < b->visible - 6) {
+		if (!StartNewPiece(b, ChooseShape(&stdTable, &r)))
+			break;
+		for (i = StreamRandom(&r, 0, 4); i > 0; --i)
+			RotatePiece(b);
+		for (i = StreamRandom(&r, -5, 6);
+				i && MovePiece(b, 0, i < 0 ? -1 : 1); i += i < 0 ? 1 : -1)
+			;
+		DropPiece(b);
+		LandPiece(b);
+	}
+	StartNewPiece(b, ChooseShape(&stdTable, &r));
+	for (y = 0; y < b->visible; ++y)
+		memcpy(views[seed % CORPUS_SIZE][y], BoardLine(b, y), b->width);
+}
+
+static void BuildCorpus(void)
+{
+	int i, y, x;
+
+	for (numShapes = 0; netMapping[numShapes]; ++numShapes)
+		allShapes[numShapes] = netMapping[numShapes];
+	for (i = 0; i < CORPUS_SIZE; ++i) {
+		BuildPosition(&corpus[i], i, i % 12);
+		fullLines[i] = corpus[i];
+		for (y = 0; y < 1 + i % 4; ++y)
+			for (x = 0; x < fullLines[i].width; ++x)
+				if (!GetBlock(&fullLines[i], y, x))
+					SetBlock(&fullLines[i], y, x, BT_white);
+	}
+}
+
+static int CountFunc(Board *b, int y, int x, BlockType type, void *data)
+{
+	return ++*(int *)data < 0;
+}
+
+static long BenchShapeIterate(long ops)
+{
+	long op, sum = 0;
+	int count = 0;
+
+	for (op = 0; op < ops; ++op)
+		sum += ShapeIterate(allShapes[op % numShapes],
+			&corpus[op % CORPUS_SIZE], 10, 4, 0, CountFunc, &count);
+	return sum + count;
+}
+
+/* One op tries a shape at every column of one row */
+static long BenchShapeFits(long ops)
+{
+	long op, sum = 0;
+	Board *b;
+	int x;
+
+	for (op = 0; op < ops; ++op) {
+		b = &corpus[op % CORPUS_SIZE];
+		for (x = 0; x < b->width; ++x)
+			sum += ShapeFits(allShapes[op % numShapes], b, op % 8, x);
+	}
+	return sum;
+}
+
+static long BenchMovePiece(long ops)
+{
+	long op, sum = 0;
+
+	work = corpus[0];
+	for (op = 0; op < ops; ++op)
+		sum += MovePiece(&work, 0, op & 1 ? -1 : 1);
+	return sum;
+}
+
+/* Drops the piece, then lifts it back where it was */
+static long BenchDropPiece(long ops)
+{
+	long op, sum = 0;
+	Board *b;
+	int count;
+
+	for (op = 0; op < ops; ++op) {
+		b = &corpus[op % CORPUS_SIZE];
+		count = DropPiece(b);
+		MovePiece(b, count, 0);
+		sum += count;
+	}
+	return sum;
+}
+
+static long BenchCopy(long ops)
+{
+	long op, sum = 0;
+
+	for (op = 0; op < ops; ++op) {
+		work = fullLines[op % CORPUS_SIZE];
+		sum += work.curY;
+	}
+	return sum;
+}
+
+static long BenchClearFullLines(long ops)
+{
+	long op, sum = 0;
+
+	for (op = 0; op < ops; ++op) {
+		work = fullLines[op % CORPUS_SIZE];
+		sum += ClearFullLines(&work);
+	}
+	return sum;
+}
+
+static long BenchInsertJunk(long ops)
+{
+	long op, sum = 0;
+
+	for (op = 0; op < ops; ++op) {
+		work = fullLines[op % CORPUS_SIZE];
+		InsertJunk(&work, 1 + op % 4, op % work.width);
+		sum += work.curY;
+	}
+	return sum;
+}
+
+static long BenchFreezePiece(long ops)
+{
+	long op, sum = 0;
+
+	for (op = 0; op < ops; ++op) {
+		work = fullLines[op % CORPUS_SIZE];
+		FreezePiece(&work);
+		sum += work.curY;
+	}
+	return sum;
+}
+
+/* Moves the piece and shows it to an observer that draws nothing */
+static long BenchRefreshBoard(long ops)
+{
+	long op, sum = 0;
+
+	work = corpus[0];
+	work.observer = &nullObserver;
+	for (op = 0; op < ops; ++op) {
+		sum += MovePiece(&work, 0, op & 1 ? -1 : 1);
+		sum += RefreshBoard(&work);
+	}
+	return sum;
+}
+
+static long ChooseShapes(long ops, int legacy)
+{
+	RandStream r;
+	long op, sum = 0;
+
+	SeedStream(&r, 1, legacy);
+	for (op = 0; op < ops; ++op)
+		sum += ChooseShape(&stdTable, &r)->type;
+	return sum;
+}
+
+static long BenchChooseShape(long ops)
+{
+	return ChooseShapes(ops, 0);
+}
+
+static long BenchChooseLegacy(long ops)
+{
+	return ChooseShapes(ops, 1);
+}
+
+static long BenchMakeDecision(long ops)
+{
+	long op;
+	double sum = 0;
+
+	for (op = 0; op < ops; ++op)
+		sum += RobotDecide(corpus[0].visible, corpus[0].width,
+			views[op % CORPUS_SIZE]);
+	return (long)sum;
+}
+
+static long BenchBoardScore(long ops)
+{
+	long op;
+	double sum = 0;
+
+	for (op = 0; op < ops; ++op)
+		sum += RobotScore(corpus[0].visible, corpus[0].width,
+			views[op % CORPUS_SIZE]);
+	return (long)sum;
+}
+
+static Bench benches[] = {
+	{ "ShapeIterate",	NULL,		BenchShapeIterate },
+	{ "ShapeFits",		NULL,		BenchShapeFits },
+	{ "MovePiece",		NULL,		BenchMovePiece },
+	{ "DropPiece",		NULL,		BenchDropPiece },
+	{ "BoardCopy",		NULL,		BenchCopy },
+	{ "ClearFullLines",	"BoardCopy",	BenchClearFullLines },
+	{ "InsertJunk",		"BoardCopy",	BenchInsertJunk },
+	{ "FreezePiece",	"BoardCopy",	BenchFreezePiece },
+	{ "RefreshBoard",	"MovePiece",	BenchRefreshBoard },
+	{ "ChooseShape",	NULL,		BenchChooseShape },
+	{ "ChooseLegacy",	NULL,		BenchChooseLegacy },
+	{ "MakeDecision",	NULL,		BenchMakeDecision },
+	{ "BoardScore",		NULL,		BenchBoardScore },
+	{ NULL }
+};
+
+static long checksum;
+
+static double Seconds(void)
+{
+	return MonoTime() / 1e9;
+}
+
+static double TimeOps(Bench *bench, long ops)
+{
+	double start = Seconds();
+
+	checksum += bench->run(ops);
+	return Seconds() - start;
+}
+
+static int CompareDouble(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* ns/op for bench: one warmup run, then the median of numRuns */
+static void RunBench(Bench *bench)
+{
+	double times[64], secs;
+	long ops = 1;
+	int run;
+
+	while ((secs = TimeOps(bench, ops)) < runMsec / 10000.0)
+		ops *= 2;
+	ops = ops * (runMsec / 1000.0) / (secs > 0 ? secs : 1e-6) + 1;
+	TimeOps(bench, ops);
+	for (run = 0; run < numRuns; ++run)
+		times[run] = TimeOps(bench, ops) * 1e9 / ops;
+	qsort(times, numRuns, sizeof(times[0]), CompareDouble);
+	bench->best = times[0];
+	bench->median = times[numRuns / 2];
+}
+
+static Bench *FindBench(char *name)
+{
+	Bench *bench;
+
+	for (bench = benches; bench->name; ++bench)
+		if (!strcmp(bench->name, name))
+			return bench;
+	return NULL;
+}
+
+static void BenchUsage(void)
+{
+	fprintf(stderr,
+	  "Usage: netris-bench [-l] [-r runs] [-t msec] [benchmark...]\n"
+	  "  -l\t\tList the benchmarks\n"
+	  "  -r <runs>\tTimed runs of each benchmark, after a warmup (5)\n"
+	  "  -t <msec>\tLength of each run (200)\n");
+}
+
+ExtFunc int main(int argc, char **argv)
+{
+	Bench *bench, *base;
+	double net;
+	int ch, i;
+
+	while ((ch = getopt(argc, argv, "lr:t:h")) != -1)
+		switch (ch) {
+			case 'l':
+				for (bench = benches; bench->name; ++bench)
+					printf("%s\n", bench->name);
+				exit(0);
+			case 'r':
+				numRuns = atoi(optarg);
+				break;
+			case 't':
+				runMsec = atoi(optarg);
+				break;
+			case 'h':
+				BenchUsage();
+				exit(0);
+			default:
+				BenchUsage();
+				exit(1);
+		}
+	if (numRuns < 1 || numRuns > 64 || runMsec < 1) {
+		BenchUsage();
+		exit(1);
+	}
+	for (i = optind; i < argc; ++i)
+		if (!FindBench(argv[i])) {
+			fprintf(stderr, "No benchmark called '%s'\n", argv[i]);
+			exit(1);
+		}
+	InitShapes();
+	BuildCorpus();
+	printf("%-16s %12s %12s %12s %14s\n",
+		"benchmark", "ns/op", "best", "net", "ops/sec");
+	for (bench = benches; bench->name; ++bench) {
+		if (optind < argc) {
+			for (i = optind; i < argc; ++i)
+				if (!strcmp(argv[i], bench->name))
+					break;
+			if (i == argc)
+				continue;
+		}
+		base = bench->base ? FindBench(bench->base) : NULL;
+		if (base && base->median == 0)
+			RunBench(base);
+		RunBench(bench);
+		net = base ? bench->median - base->median : bench->median;
+		printf("%-16s %12.1f %12.1f %12.1f %14.0f\n", bench->name,
+			bench->median, bench->best, net, 1e9 / bench->median);
+	}
+	if (checksum == 42)
+		printf("\n");	/* Keeps the compiler from skipping the work */
+	return 0;
+}
+
+/*
+ * vi: ts=4 ai
+ * vim: noai si
+ */
@@ -20,6 +20,10 @@
 
 #include "netris.h"
 #include <stdlib.h>
+#include <string.h>
+
+#define ROW(b, y)			(b)->rows[(b)->rowMap[y]]
+#define BLOCK(b, y, x)		(b)->block[(b)->rowMap[y]][x]
 
 #ifdef DEBUG_FALLING
 # define B_OLD
@@ -27,229 +31,506 @@
 # define B_OLD abs
 #endif
 
-static BlockType board[MAX_SCREENS][MAX_BOARD_HEIGHT][MAX_BOARD_WIDTH];
-static BlockType oldBoard[MAX_SCREENS][MAX_BOARD_HEIGHT][MAX_BOARD_WIDTH];
-static unsigned int changed[MAX_SCREENS][MAX_BOARD_HEIGHT];
-static int falling[MAX_SCREENS][MAX_BOARD_WIDTH];
-static int oldFalling[MAX_SCREENS][MAX_BOARD_WIDTH];
+/*
+ * All of a board's state lives in its Board (see netris.h), so any number
+ * of them can be played at once.  Nothing in here draws anything; that's
+ * left to the board's observer, if it has one.
+ */
 
-ExtFunc void InitBoard(int scr)
+ExtFunc void InitBoard(Board *b, BoardObserver *observer, int scr)
 {
-	int s,w,h;
-
-	for(s = 0 ; s < MAX_SCREENS ; s++)
-		for(h = 0 ; h < MAX_BOARD_HEIGHT ; h++)
-			for(w = 0 ; w < MAX_BOARD_WIDTH ; w++) {
-				board[s][h][w] = 0;
-				oldBoard[s][h][w] = 0;
-				changed[s][h] = 0;
-				falling[s][w] = 0;
-				oldFalling[s][w] = 0;
-			}
-
-	boardHeight[scr] = MAX_BOARD_HEIGHT;
-	boardVisible[scr] = 20;
-	boardWidth[scr] = 10;
-	InitScreen(scr);
+	int y;
+
+	memset(b, 0, sizeof(*b));
+	for (y = 0; y < MAX_BOARD_HEIGHT; ++y)
+		b->rowMap[y] = y;
+	b->observer = observer;
+	b->scr = scr;
+	b->height = MAX_BOARD_HEIGHT;
+	b->visible = 20;
+	b->width = 10;
+	b->fullRow = ROW_MASK(b->width);
+	if (observer && observer->init)
+		observer->init(b);
 }
 
-ExtFunc void CleanupBoard(int scr)
+ExtFunc void CleanupBoard(Board *b)
 {
-	CleanupScreen(scr);
+	if (b->observer && b->observer->cleanup)
+		b->observer->cleanup(b);
 }
 
-ExtFunc BlockType GetBlock(int scr, int y, int x)
+ExtFunc BlockType GetBlock(Board *b, int y, int x)
 {
-	if (y < 0 || x < 0 || x >= boardWidth[scr])
+	if (y < 0 || x < 0 || x >= b->width)
 		return BT_wall;
-	else if (y >= boardHeight[scr])
+	else if (y >= b->height)
 		return BT_none;
 	else
-		return abs(board[scr][y][x]);
+		return abs(BLOCK(b, y, x));
+}
+
+/* Line y as stored, falling piece negative; y must be on the board */
+ExtFunc BlockType *BoardLine(Board *b, int y)
+{
+	return b->block[b->rowMap[y]];
+}
+
+/* Lower colTop[x] to one past the highest settled block below line y */
+static void FindTop(Board *b, int x, int y)
+{
+	while (y > 0 && BLOCK(b, y - 1, x) <= 0)
+		--y;
+	b->colTop[x] = y;
 }
 
-ExtFunc void SetBlock(int scr, int y, int x, BlockType type)
+ExtFunc void SetBlock(Board *b, int y, int x, BlockType type)
 {
-	if (y >= 0 && y < boardHeight[scr] && x >= 0 && x < boardWidth[scr]) {
-		if (y < boardVisible[scr])
-			falling[scr][x] += (type < 0) - (board[scr][y][x] < 0);
-		board[scr][y][x] = type;
-		changed[scr][y] |= 1 << x;
+	BlockType old;
+
+	if (y >= 0 && y < b->height && x >= 0 && x < b->width) {
+		old = BLOCK(b, y, x);
+		if (y < b->visible)
+			b->falling[x] += (type < 0) - (old < 0);
+		BLOCK(b, y, x) = type;
+		if (type)
+			ROW(b, y) |= (BoardRow)1 << x;
+		else
+			ROW(b, y) &= ~((BoardRow)1 << x);
+		b->changed[y] |= 1 << x;
+		if (type > 0) {
+			if (y >= b->colTop[x])
+				b->colTop[x] = y + 1;
+		}
+		else if (old > 0 && y == b->colTop[x] - 1)
+			FindTop(b, x, y);
 	}
 }
 
-ExtFunc int RefreshBoard(int scr)
+ExtFunc int RefreshBoard(Board *b)
 {
+	BoardObserver *obs = b->observer;
 	int y, x, any = 0;
 	unsigned int c;
-	BlockType b;
-
-	for (y = boardVisible[scr] - 1; y >= 0; --y)
-		if ((c = changed[scr][y])) {
-			if (robotEnable) {
-				RobotCmd(0, "RowUpdate %d %d", scr, y);
-				for (x = 0; x < boardWidth[scr]; ++x) {
-					b = board[scr][y][x];
-					if (fairRobot)
-						b = abs(b);
-					RobotCmd(0, " %d", b);
-				}
-				RobotCmd(0, "\n");
-			}
-			changed[scr][y] = 0;
+
+	if (!obs)
+		return 0;
+	for (y = b->visible - 1; y >= 0; --y)
+		if ((c = b->changed[y])) {
+			if (obs->rowUpdate)
+				obs->rowUpdate(b, y, b->block[b->rowMap[y]]);
+			b->changed[y] = 0;
 			any = 1;
 			for (x = 0; c; (c >>= 1), (++x))
-				if ((c & 1) && B_OLD(board[scr][y][x])!=oldBoard[scr][y][x]) {
-					PlotBlock(scr, y, x, B_OLD(board[scr][y][x]));
-					oldBoard[scr][y][x] = B_OLD(board[scr][y][x]);
+				if ((c & 1) && B_OLD(BLOCK(b, y, x)) != b->oldBlock[y][x]) {
+					b->oldBlock[y][x] = B_OLD(BLOCK(b, y, x));
+					if (obs->plotBlock)
+						obs->plotBlock(b, y, x, b->oldBlock[y][x]);
 				}
 		}
-	if (robotEnable)
-		RobotTimeStamp();
-	for (x = 0; x < boardWidth[scr]; ++x)
-		if (oldFalling[scr][x] != !!falling[scr][x]) {
-			oldFalling[scr][x] = !!falling[scr][x];
-			PlotUnderline(scr, x, oldFalling[scr][x]);
+	if (obs->refreshed)
+		obs->refreshed(b);
+	for (x = 0; x < b->width; ++x)
+		if (b->oldFalling[x] != !!b->falling[x]) {
+			b->oldFalling[x] = !!b->falling[x];
+			if (obs->plotUnderline)
+				obs->plotUnderline(b, x, b->oldFalling[x]);
 			any = 1;
 		}
 	return any;
 }
 
-ExtFunc int PlotFunc(int scr, int y, int x, BlockType type, void *data)
+/* Whether RefreshBoard would have anything to show */
+ExtFunc int BoardDirty(Board *b)
 {
-	SetBlock(scr, y, x, type);
+	int y, x;
+
+	if (!b->observer)
+		return 0;
+	for (y = 0; y < b->visible; ++y)
+		if (b->changed[y])
+			return 1;
+	for (x = 0; x < b->width; ++x)
+		if (b->oldFalling[x] != !!b->falling[x])
+			return 1;
 	return 0;
 }
 
-ExtFunc int EraseFunc(int scr, int y, int x, BlockType type, void *data)
+/* The observer couldn't show (y, x) yet; the next RefreshBoard tries again */
+ExtFunc void UnplotBlock(Board *b, int y, int x)
 {
-	SetBlock(scr, y, x, BT_none);
+	b->oldBlock[y][x] = BT_len;
+	b->changed[y] |= 1 << x;
+}
+
+ExtFunc void UnplotUnderline(Board *b, int x)
+{
+	b->oldFalling[x] = -1;
+}
+
+ExtFunc int PlotFunc(Board *b, int y, int x, BlockType type, void *data)
+{
+	SetBlock(b, y, x, type);
+	return 0;
+}
+
+ExtFunc int EraseFunc(Board *b, int y, int x, BlockType type, void *data)
+{
+	SetBlock(b, y, x, BT_none);
 	return 0;
 }
 
-ExtFunc int CollisionFunc(int scr, int y, int x, BlockType type, void *data)
+ExtFunc int CollisionFunc(Board *b, int y, int x, BlockType type, void *data)
 {
-	return GetBlock(scr, y, x) != BT_none;
+	if (y < 0 || x < 0 || x >= b->width)
+		return 1;
+	if (y >= b->height)
+		return 0;
+	return (ROW(b, y) >> x) & 1;
 }
 
-ExtFunc int VisibleFunc(int scr, int y, int x, BlockType type, void *data)
+ExtFunc int VisibleFunc(Board *b, int y, int x, BlockType type, void *data)
 {
-	return (y >= 0 && y < boardVisible[scr] && x >= 0 && x < boardWidth[scr]);
+	return (y >= 0 && y < b->visible && x >= 0 && x < b->width);
+}
+
+ExtFunc void PlotShape(Shape *shape, Board *b, int y, int x, int falling)
+{
+	int i, n, by, bx;
+	BlockType type;
+
+	type = falling ? -shape->type : shape->type;
+	for (i = n = 0; i < shape->numCells; ++i) {
+		by = y + shape->cellY[i];
+		bx = x + shape->cellX[i];
+		SetBlock(b, by, bx, type);
+		if (falling && by >= 0 && by < b->height
+				&& bx >= 0 && bx < b->width) {
+			b->pieceY[n] = by;
+			b->pieceX[n] = bx;
+			++n;
+		}
+	}
+	if (falling)
+		b->pieceCells = n;
 }
 
-ExtFunc void PlotShape(Shape *shape, int scr, int y, int x, int falling)
+ExtFunc void EraseShape(Shape *shape, Board *b, int y, int x)
 {
-	ShapeIterate(shape, scr, y, x, falling, PlotFunc, NULL);
+	int i;
+
+	for (i = 0; i < shape->numCells; ++i)
+		SetBlock(b, y + shape->cellY[i], x + shape->cellX[i], BT_none);
 }
 
-ExtFunc void EraseShape(Shape *shape, int scr, int y, int x)
+/* Erase the falling piece, wherever it was last plotted */
+static void ErasePiece(Board *b)
 {
-	ShapeIterate(shape, scr, y, x, 0, EraseFunc, NULL);
+	int i;
+
+	for (i = 0; i < b->pieceCells; ++i)
+		SetBlock(b, b->pieceY[i], b->pieceX[i], BT_none);
+	b->pieceCells = 0;
 }
 
-ExtFunc int ShapeFits(Shape *shape, int scr, int y, int x)
+ExtFunc int ShapeFits(Shape *shape, Board *b, int y, int x)
 {
-	return !ShapeIterate(shape, scr, y, x, 0, CollisionFunc, NULL);
+	int i, row;
+
+	y += shape->minY;
+	x += shape->minX;
+	if (y < 0 || x < 0 || x + shape->maxX - shape->minX >= b->width)
+		return 0;
+	for (i = 0; i < shape->height; ++i) {
+		if ((row = y + i) >= b->height)
+			break;
+		if (ROW(b, row) & (shape->rowMask[i] << x))
+			return 0;
+	}
+	return 1;
 }
 
-ExtFunc int ShapeVisible(Shape *shape, int scr, int y, int x)
+ExtFunc int ShapeVisible(Shape *shape, Board *b, int y, int x)
 {
-	return ShapeIterate(shape, scr, y, x, 0, VisibleFunc, NULL);
+	int i;
+
+	for (i = 0; i < shape->numCells; ++i)
+		if (VisibleFunc(b, y + shape->cellY[i], x + shape->cellX[i],
+					BT_none, NULL))
+			return 1;
+	return 0;
 }
 
-ExtFunc int MovePiece(int scr, int deltaY, int deltaX)
+ExtFunc int MovePiece(Board *b, int deltaY, int deltaX)
 {
 	int result;
 
-	EraseShape(curShape[scr], scr, curY[scr], curX[scr]);
-	result = ShapeFits(curShape[scr], scr, curY[scr] + deltaY,
-				curX[scr] + deltaX);
+	ErasePiece(b);
+	result = ShapeFits(b->curShape, b, b->curY + deltaY, b->curX + deltaX);
 	if (result) {
-		curY[scr] += deltaY;
-		curX[scr] += deltaX;
+		b->curY += deltaY;
+		b->curX += deltaX;
 	}
-	PlotShape(curShape[scr], scr, curY[scr], curX[scr], 1);
+	PlotShape(b->curShape, b, b->curY, b->curX, 1);
 	return result;
 }
 
-ExtFunc int RotatePiece(int scr)
+/*
+ * Move the piece up to |deltaX| columns sideways, as far as it'll go, in
+ * one go.  Returns how far it actually moved, with deltaX's sign.
+ */
+ExtFunc int ShiftPiece(Board *b, int deltaX)
+{
+	int step = deltaX < 0 ? -1 : 1, moved = 0;
+
+	ErasePiece(b);
+	while (moved != deltaX
+			&& ShapeFits(b->curShape, b, b->curY, b->curX + moved + step))
+		moved += step;
+	b->curX += moved;
+	PlotShape(b->curShape, b, b->curY, b->curX, 1);
+	return moved;
+}
+
+ExtFunc int RotatePiece(Board *b)
 {
 	int result;
 
-	EraseShape(curShape[scr], scr, curY[scr], curX[scr]);
-	result = ShapeFits(curShape[scr]->rotateTo, scr, curY[scr], curX[scr]);
+	ErasePiece(b);
+	result = ShapeFits(b->curShape->rotateTo, b, b->curY, b->curX);
 	if (result)
-		curShape[scr] = curShape[scr]->rotateTo;
-	PlotShape(curShape[scr], scr, curY[scr], curX[scr], 1);
+		b->curShape = b->curShape->rotateTo;
+	PlotShape(b->curShape, b, b->curY, b->curX, 1);
 	return result;
 }
 
-ExtFunc int DropPiece(int scr)
+/*
+ * Where a shape that fits at (y, x) comes to rest if dropped.  If it's
+ * above the stack in all its columns that's straight from colTop[];
+ * only when it's tucked under an overhang do we have to search.
+ */
+ExtFunc int LandingRow(Shape *shape, Board *b, int y, int x)
 {
-	int count = 0;
+	int i, row, land;
+
+	land = -shape->minY;
+	for (i = 0; i <= shape->maxX - shape->minX; ++i)
+		if (shape->colBottom[i] < MAX_BOARD_HEIGHT) {
+			row = b->colTop[x + shape->minX + i] - shape->colBottom[i];
+			if (land < row)
+				land = row;
+		}
+	if (land <= y)
+		return land;
+	while (ShapeFits(shape, b, y - 1, x))
+		--y;
+	return y;
+}
 
-	EraseShape(curShape[scr], scr, curY[scr], curX[scr]);
-	while (ShapeFits(curShape[scr], scr, curY[scr] - 1, curX[scr])) {
-		--curY[scr];
-		++count;
-	}
-	PlotShape(curShape[scr], scr, curY[scr], curX[scr], 1);
+ExtFunc int DropPiece(Board *b)
+{
+	int count;
+
+	ErasePiece(b);
+	count = b->curY;
+	b->curY = LandingRow(b->curShape, b, b->curY, b->curX);
+	count -= b->curY;
+	PlotShape(b->curShape, b, b->curY, b->curX, 1);
 	return count;
 }
 
-ExtFunc int LineIsFull(int scr, int y)
+/* Put the falling piece at (y, x) without asking whether it fits */
+ExtFunc void PlacePiece(Board *b, Shape *shape, int y, int x)
 {
-	int x;
+	ErasePiece(b);
+	b->curShape = shape;
+	b->curY = y;
+	b->curX = x;
+	PlotShape(shape, b, y, x, 1);
+}
 
-	for (x = 0; x < boardWidth[scr]; ++x)
-		if (GetBlock(scr, y, x) == BT_none)
-			return 0;
+ExtFunc int StartNewPiece(Board *b, Shape *shape)
+{
+	b->curShape = shape;
+	b->curY = b->visible + 4;
+	b->curX = b->width / 2;
+	while (!ShapeVisible(shape, b, b->curY, b->curX))
+		--b->curY;
+	if (!ShapeFits(shape, b, b->curY, b->curX))
+		return 0;
+	PlotShape(shape, b, b->curY, b->curX, 1);
 	return 1;
 }
 
-ExtFunc void CopyLine(int scr, int from, int to)
+/* The falling piece has come to rest; returns the number of lines cleared */
+ExtFunc int LandPiece(Board *b)
 {
-	int x;
+	FreezePiece(b);
+	return ClearFullLines(b);
+}
 
-	if (from != to)
-		for (x = 0; x < boardWidth[scr]; ++x)
-			SetBlock(scr, to, x, GetBlock(scr, from, x));
+/* How many junk lines the opponent gets for clearing this many at once */
+ExtFunc int JunkLines(int linesCleared)
+{
+	if (linesCleared < 2)
+		return 0;
+	return linesCleared - (linesCleared < 4);
 }
 
-ExtFunc int ClearFullLines(int scr)
+ExtFunc int LineIsFull(Board *b, int y)
 {
-	int from, to;
+	return y >= 0 && y < b->height && ROW(b, y) == b->fullRow;
+}
 
-	from = to = 0;
-	while (to < boardHeight[scr]) {
-		while (LineIsFull(scr, from))
-			++from;
-		CopyLine(scr, from++, to++);
+ExtFunc void CopyLine(Board *b, int from, int to)
+{
+	int x, visible;
+	BoardRow bits;
+
+	if (from == to)
+		return;
+	bits = (from >= 0 && from < b->height) ? ROW(b, from) : 0;
+	if (!bits && !ROW(b, to))
+		return;		/* Both empty, the common case above the stack */
+	visible = to < b->visible;
+	for (x = 0; x < b->width; ++x) {
+		if (visible)
+			b->falling[x] -= BLOCK(b, to, x) < 0;
+		BLOCK(b, to, x) = (bits >> x) & 1 ? abs(BLOCK(b, from, x)) : 0;
+		if (BLOCK(b, to, x)) {
+			if (to >= b->colTop[x])
+				b->colTop[x] = to + 1;
+		}
+		else if (to == b->colTop[x] - 1)
+			FindTop(b, x, to);
 	}
-	return from - to;
+	ROW(b, to) = bits;
+	b->changed[to] |= b->fullRow;
 }
 
-ExtFunc void FreezePiece(int scr)
+/* One past the highest line with anything in it */
+static int StackHeight(Board *b)
 {
-	int y, x;
-	BlockType type;
+	int y;
 
-	for (y = 0; y < boardHeight[scr]; ++y)
-		for (x = 0; x < boardWidth[scr]; ++x)
-			if ((type = board[scr][y][x]) < 0)
-				SetBlock(scr, y, x, -type);
+	for (y = b->height; y > 0 && !ROW(b, y - 1); --y)
+		;
+	return y;
 }
 
-ExtFunc void InsertJunk(int scr, int count, int column)
+static void MarkLines(Board *b, int from, int to)
 {
-	int y, x;
+	if (to > b->visible)
+		to = b->visible;
+	for (; from < to; ++from)
+		b->changed[from] |= b->fullRow;
+}
+
+ExtFunc int ClearFullLines(Board *b)
+{
+	int from, to, top, low, phys, i, count;
+	int cleared[MAX_BOARD_HEIGHT];
+
+	FreezePiece(b);
+	top = StackHeight(b);
+	low = count = 0;
+	for (from = to = 0; from < top; ++from) {
+		phys = b->rowMap[from];
+		if (b->rows[phys] == b->fullRow) {
+			if (!count)
+				low = from;
+			cleared[count++] = phys;
+		}
+		else
+			b->rowMap[to++] = phys;
+	}
+	if (!count)
+		return 0;
+
+	/* Everything above the stack is empty already, so the cleared
+	 * lines can go back in just below it */
+	for (i = 0; i < count; ++i) {
+		phys = cleared[i];
+		b->rows[phys] = 0;
+		memset(b->block[phys], 0, sizeof(b->block[phys]));
+		b->rowMap[to++] = phys;
+	}
+
+	/* Every cleared line was below the top of every column */
+	for (i = 0; i < b->width; ++i)
+		FindTop(b, i, b->colTop[i] - count);
+	MarkLines(b, low, top);
+	return count;
+}
 
-	for (y = boardHeight[scr] - count - 1; y >= 0; --y)
-		CopyLine(scr, y, y + count);
-	for (y = 0; y < count; ++y)
-		for (x = 0; x < boardWidth[scr]; ++x)
-			SetBlock(scr, y, x, (x == column) ? BT_none : BT_white);
-	curY[scr] += count;
+ExtFunc void FreezePiece(Board *b)
+{
+	int i, y, x;
+	BlockType type;
+
+	for (i = 0; i < b->pieceCells; ++i) {
+		y = b->pieceY[i];
+		x = b->pieceX[i];
+		if ((type = BLOCK(b, y, x)) < 0)
+			SetBlock(b, y, x, -type);
+	}
+	b->pieceCells = 0;
+}
+
+ExtFunc void InsertJunk(Board *b, int count, int column)
+{
+	int i, y, x, n, top, phys;
+	int liftY[MAX_SHAPE_CELLS], liftX[MAX_SHAPE_CELLS];
+	BlockType liftType[MAX_SHAPE_CELLS];
+	int recycled[MAX_BOARD_HEIGHT];
+	BoardRow junk;
+
+	if (count <= 0)
+		return;
+	if (count > b->height)
+		count = b->height;
+
+	/* Take the falling piece off the board and put it back higher up */
+	n = b->pieceCells;
+	for (i = 0; i < n; ++i) {
+		liftY[i] = b->pieceY[i];
+		liftX[i] = b->pieceX[i];
+		liftType[i] = BLOCK(b, liftY[i], liftX[i]);
+	}
+	ErasePiece(b);
+
+	/* The lines pushed off the top are reused for the junk */
+	top = StackHeight(b);
+	for (i = 0; i < count; ++i)
+		recycled[i] = b->rowMap[b->height - count + i];
+	memmove(&b->rowMap[count], &b->rowMap[0],
+			(b->height - count) * sizeof(b->rowMap[0]));
+	junk = b->fullRow;
+	if (column >= 0 && column < b->width)
+		junk &= ~((BoardRow)1 << column);
+	for (y = 0; y < count; ++y) {
+		phys = b->rowMap[y] = recycled[y];
+		b->rows[phys] = junk;
+		for (x = 0; x < b->width; ++x)
+			b->block[phys][x] = (x == column) ? BT_none : BT_white;
+	}
+	MarkLines(b, 0, top + count);
+	for (x = 0; x < b->width; ++x)
+		if (b->colTop[x] + count > b->height)
+			FindTop(b, x, b->height);
+		else if (b->colTop[x])
+			b->colTop[x] += count;
+		else if ((junk >> x) & 1)
+			b->colTop[x] = count;
+
+	for (i = 0; i < n; ++i)
+		if ((y = liftY[i] + count) < b->height) {
+			SetBlock(b, y, liftX[i], liftType[i]);
+			b->pieceY[b->pieceCells] = y;
+			b->pieceX[b->pieceCells] = liftX[i];
+			++b->pieceCells;
+		}
+	b->curY += count;
 }
 
 /*
@@ -21,14 +21,12 @@
  */
 
 #include "netris.h"
-#include <time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <curses.h>
 #include <term.h>
 #include <string.h>
 #include <stdlib.h>
-#include <stdarg.h>
 
 #ifdef NCURSES_VERSION
 // PDCurses *also* sets NCURSES_VERSION, and supports the same features
@@ -141,27 +139,15 @@ static struct
 
 #endif
 
-static void PlotBlock1(int scr, int y, int x, BlockType type);
-static MyEventType KeyGenFunc(EventGenRec *gen, MyEvent *event);
-
-static EventGenRec keyGen =
-		{ NULL, 0, FT_read, STDIN_FILENO, KeyGenFunc, EM_key };
+/*
+ * The curses backend; see render.c.  All of this runs on the render
+ * thread, and the game's thread never touches curses.
+ */
 
-static int boardYPos[MAX_SCREENS], boardXPos[MAX_SCREENS];
-static int statusYPos, statusXPos;
 static int haveColor;
-static int screens_dirty = 0;
 
-ExtFunc void InitScreens(void)
+static void CursesInit(void)
 {
-	MySigSet oldMask;
-
-	/*
-	 * Block signals while initializing curses.  Otherwise a badly timed
-	 * Ctrl-C during initialization might leave the terminal in a bad state.
-	 */
-	BlockSignals(&oldMask, SIGINT, 0);
-
 #ifndef HAVE_ENHANCED_CURSES
 	GetTermcapInfo();
 #endif
@@ -196,103 +182,30 @@ ExtFunc void InitScreens(void)
 	haveColor = 0;
 #endif
 
-	AtExit(CleanupScreens);
-	screens_dirty = 1;
-	RestoreSignals(NULL, &oldMask);
-
 	cbreak();
 	noecho();
 	curs_set(0);
-	AddEventGen(&keyGen);
-
-	move(0, 0);
-	addstr("Netris ");
-	addstr(version_string);
-	addstr(" (C) 1994-2016  Mark H. Weaver et al");
-	mvprintw(0, 55, "\"netris -h\" for more info");
-
-	statusYPos = 22;
-	statusXPos = 0;
-}
-
-ExtFunc void CleanupScreens(void)
-{
-	if (screens_dirty) {
-		RemoveEventGen(&keyGen);
-		endwin();
-		curs_set(1);
-		screens_dirty = 0;
-	}
 }
 
-ExtFunc void InitScreen(int scr)
+static void CursesCleanup(void)
 {
-	int y, x;
-
-	if (scr == 0)
-		boardXPos[scr] = 1;
-	else
-		boardXPos[scr] = boardXPos[scr - 1] +
-					2 * boardWidth[scr - 1] + 3;
-	boardYPos[scr] = 22;
-	if (statusXPos < boardXPos[scr] + 2 * boardWidth[scr] + 3)
-		statusXPos = boardXPos[scr] + 2 * boardWidth[scr] + 3;
-	for (y = boardVisible[scr] - 1; y >= 0; --y) {
-		move(boardYPos[scr] - y, boardXPos[scr] - 1);
-		addch('|');
-		for (x = boardWidth[scr] - 1; x >= 0; --x)
-			addstr("  ");
-		move(boardYPos[scr] - y, boardXPos[scr] + 2 * boardWidth[scr]);
-		addch('|');
-	}
-	for (y = boardVisible[scr]; y >= -1; y -= boardVisible[scr] + 1) {
-		move(boardYPos[scr] - y, boardXPos[scr] - 1);
-		addch('+');
-		for (x = boardWidth[scr] - 1; x >= 0; --x)
-			addstr("--");
-		addch('+');
-	}
+	endwin();
+	curs_set(1);
 }
 
-ExtFunc void InvertScreen(int scr)
-{
-	int y, x;
-
-	if (scr == 0)
-		boardXPos[scr] = 1;
-	else
-		boardXPos[scr] = boardXPos[scr - 1] +
-					2 * boardWidth[scr - 1] + 3;
-
-	for (y = 0; y < boardVisible[scr]; y++) {
-		int ry = 3 + y;
-		for (x = 0; x < 2 * boardWidth[scr]; x++) {
-			int rx = boardXPos[scr] + x;
-			move(ry, rx);
-			chtype attrs = inch();
-#ifdef HAVE_ENHANCED_CURSES
-			int colorpair = PAIR_NUMBER(attrs);
-			if (colorpair != 0)
-				chgat(1, A_REVERSE, colorpair, NULL);
-#else
-			if(attrs != ' ') {
-				attrs ^= A_STANDOUT;
-				addch(attrs);
-			}
-#endif
-		}
-	}
-}
-
-ExtFunc void CleanupScreen(int scr)
+static void CursesText(int y, int x, char *s, int eol)
 {
+	move(y, x);
+	addstr(s);
+	if (eol)
+		clrtoeol();
 }
 
-static void PlotBlock1(int scr, int y, int x, BlockType type)
+static void CursesBlock(int y, int x, BlockType type)
 {
 	int colorIndex = abs(type);
 
-	move(boardYPos[scr] - y, boardXPos[scr] + 2 * x);
+	move(y, x);
 
 	if (type == BT_none)
 		addstr("  ");
@@ -314,160 +227,44 @@ static void PlotBlock1(int scr, int y, int x, BlockType type)
 	}
 }
 
-ExtFunc void PlotBlock(int scr, int y, int x, BlockType type)
-{
-	if (y >= 0 && y < boardVisible[scr] && x >= 0 && x < boardWidth[scr])
-		PlotBlock1(scr, y, x, type);
-}
-
-ExtFunc void PlotUnderline(int scr, int x, int flag)
-{
-	move(boardYPos[scr] + 1, boardXPos[scr] + 2 * x);
-	addstr(flag ? "==" : "--");
-}
-
-ExtFunc void ClearStatus(void)
-{
-	move(statusYPos - 1, statusXPos);
-	clrtoeol();
-	refresh();
-}
-
-ExtFunc void PrintStatus(const char *fmt, ...)
+static void CursesInvert(int y, int x, int width)
 {
-	va_list argp;
-	move(statusYPos - 1, statusXPos);
+	int i;
 
+	for (i = 0; i < width; i++) {
+		move(y, x + i);
+		chtype attrs = inch();
 #ifdef HAVE_ENHANCED_CURSES
-	va_start(argp, fmt);
-	vw_printw(stdscr, fmt, argp);
-	va_end(argp);
+		int colorpair = PAIR_NUMBER(attrs);
+		if (colorpair != 0)
+			chgat(1, A_REVERSE, colorpair, NULL);
 #else
-	char tmp[64];
-	va_start(argp, fmt);
-	vsnprintf(tmp, 64, fmt, argp); // "At most 64 bytes, including NULL"
-	va_end(argp);
-	printw(tmp);
+		if(attrs != ' ') {
+			attrs ^= A_STANDOUT;
+			addch(attrs);
+		}
 #endif
-
-	clrtoeol();
-	refresh();
-}
-
-ExtFunc void ShowDisplayInfo(void)
-{
-
-	move(statusYPos - 9, statusXPos);
-	printw("Seed:  %d", initSeed);
-	clrtoeol();
-	move(statusYPos - 8, statusXPos);
-	printw("Speed: %dms", speed / 1000);
-	clrtoeol();
-
-	if(gameType == GT_onePlayer) {
-		mvprintw(statusYPos - 5, statusXPos, "Games lost       %3d", 
-				 lost);
-		mvprintw(statusYPos - 4, statusXPos, "Rows (this game) %3d", 
-				 myLinesCleared);
-		mvprintw(statusYPos - 3, statusXPos, "Rows (all games) %3d", 
-				 myTotalLinesCleared);
-	} else {
-		move(statusYPos - 7, statusXPos + 15);
-		addstr(robotEnable ? "Robot" : "  You");
-
-		move(statusYPos - 7, statusXPos + 24);
-		if((opponentFlags & SCF_usingRobot)) {
-			addstr("   Robot");
-			if(opponentFlags & SCF_fairRobot)
-				addstr("(fair)");
-		} else
-			addstr("Opponent");
-		clrtoeol();
-
-		mvprintw(statusYPos - 6, statusXPos, "Games won        %3d", 
-				 won);
-		mvprintw(statusYPos - 5, statusXPos, "Rows (this game) %3d", 
-				 myLinesCleared);
-		mvprintw(statusYPos - 4, statusXPos, "Rows (all games) %3d", 
-				 myTotalLinesCleared);
-
-		mvprintw(statusYPos - 6, statusXPos + 22, "%3d", 
-				 lost);
-		mvprintw(statusYPos - 5, statusXPos + 22, "%3d", 
-				 opponentLinesCleared);
-		mvprintw(statusYPos - 4, statusXPos + 22, "%3d", 
-				 opponentTotalLinesCleared);
 	}
-
-}
-
-ExtFunc void UpdateOpponentDisplay(void)
-{
-	move(1, 0);
-	printw("Playing %s@%s", opponentName, opponentHost);
-	clrtoeol();
 }
 
-ExtFunc void ShowPause(int pausedByMe, int pausedByThem)
+static void CursesPresent(int y, int x)
 {
-	move(statusYPos - 2, statusXPos);
-
-	if(! pausedByThem && ! pausedByMe) {
-		clrtoeol();
-		return;
-	}
-
-	if(pausedByMe && pausedByThem)
-		printw("Paused by you & opponent");
-	else if(pausedByMe)
-		printw("Paused by you");
-	else if(pausedByThem)
-		printw("Paused by opponent");
-
-	clrtoeol();
-}
-
-ExtFunc void Message(char *s)
-{
-	static int line = 0;
-
-	move(statusYPos - 20 + line, statusXPos);
-	addstr(s);	/* XXX Should truncate long lines */
-	clrtoeol();
-	line = (line + 1) % 10;
-	move(statusYPos - 20 + line, statusXPos);
-	clrtoeol();
-}
-
-ExtFunc void RefreshScreen(void)
-{
-	static char timeStr[2][32];
-	time_t theTime;
-
-	time(&theTime);
-	strftime(timeStr[0], 30, "%I:%M %p", localtime(&theTime));
-	/* Just in case the local curses library sucks */
-	if (strcmp(timeStr[0], timeStr[1]))
-	{
-		move(statusYPos, statusXPos);
-		addstr(timeStr[0]);
-		strcpy(timeStr[1], timeStr[0]);
-	}
-	move(boardYPos[0] + 1, boardXPos[0] + 2 * boardWidth[0] + 1);
+	move(y, x);
 	refresh();
 }
 
-ExtFunc void ScheduleFullRedraw(void)
+static void CursesRedraw(void)
 {
 	touchwin(stdscr);
 }
 
-static MyEventType KeyGenFunc(EventGenRec *gen, MyEvent *event)
+static RenderBackend cursesBackend = {
+	CursesInit, CursesCleanup, CursesText, CursesBlock, CursesInvert,
+	CursesPresent, CursesRedraw };
+
+ExtFunc RenderBackend *CursesBackend(void)
 {
-	if (MyRead(gen->fd, &event->u.key, 1))
-		return E_key;
-	else
-		return E_none;
+	return &cursesBackend;
 }
 
 /*
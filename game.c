@@ -39,6 +39,8 @@ static char *gameNames[GT_len] = { "OnePlayer", "ClassicTwo" };
 static int dropModeEnable = 0;
 static char *robotProg;
 
+static Board boards[MAX_SCREENS];
+
 static int wonLast = 0;
 int lost = 0, won = 0;
 enum States gameState = STATE_STARTING;
@@ -78,23 +80,115 @@ ExtFunc void MapKeys(char *newKeys)
 		exit(1);
 }
 
-ExtFunc int StartNewPiece(int scr, Shape *shape)
+static void ScreenInit(Board *b)
 {
-	curShape[scr] = shape;
-	curY[scr] = boardVisible[scr] + 4;
-	curX[scr] = boardWidth[scr] / 2;
-	while (!ShapeVisible(shape, scr, curY[scr], curX[scr]))
-		--curY[scr];
-	if (!ShapeFits(shape, scr, curY[scr], curX[scr]))
-		return 0;
-	PlotShape(shape, scr, curY[scr], curX[scr], 1);
-	return 1;
+	InitScreen(b->scr, b->visible, b->width);
+}
+
+static void ScreenCleanup(Board *b)
+{
+	CleanupScreen(b->scr);
+}
+
+static void ScreenRowUpdate(Board *b, int y, BlockType *row)
+{
+	int x;
+
+	if (!robotEnable)
+		return;
+	RobotCmd(0, "RowUpdate %d %d", b->scr, y);
+	for (x = 0; x < b->width; ++x)
+		RobotCmd(0, " %d", fairRobot ? abs(row[x]) : row[x]);
+	RobotCmd(0, "\n");
+}
+
+/* If the screen is behind, the board keeps the change for later */
+static void ScreenPlotBlock(Board *b, int y, int x, BlockType type)
+{
+	if (!PlotBlock(b->scr, y, x, type))
+		UnplotBlock(b, y, x);
+}
+
+static void ScreenPlotUnderline(Board *b, int x, int flag)
+{
+	if (!PlotUnderline(b->scr, x, flag))
+		UnplotUnderline(b, x);
+}
+
+static void ScreenRefreshed(Board *b)
+{
+	if (robotEnable)
+		RobotTimeStamp();
+}
+
+static BoardObserver screenObserver = {
+	ScreenInit, ScreenCleanup, ScreenRowUpdate,
+	ScreenPlotBlock, ScreenPlotUnderline, ScreenRefreshed };
+
+/*
+ * The boards may still have changes waiting for the next frame, or that
+ * the screen was too far behind to take.  Before we stop refreshing
+ * them, wait until it's taken them all.
+ */
+static void CatchUpScreen(int count)
+{
+	int i;
+
+	do {
+		for (i = 0; i < count; ++i)
+			RefreshBoard(&boards[i]);
+	} while (SyncScreen());
+}
+
+/*
+ * With SCF_localGravity neither side sends NP_down for gravity.  Each
+ * side moves the other's piece down on its own alarm, for show.  Before
+ * any packet that depends on where the piece is, the sender sends an
+ * NP_tick with how many gravity steps the piece has taken.  The other
+ * side's board is played by a Mirror (see mirror.c), which puts their
+ * piece back where the packets say before each one.
+ */
+static int localGravity;
+static int myTicks, mySentTicks;
+static Mirror theirs;
+
+/* Send a packet about our piece, with the gravity ticks before it */
+static void SendMove(NetPacketType type, int size, void *data)
+{
+	netint2 tick[1];
+
+	if (localGravity && myTicks != mySentTicks) {
+		tick[0] = hton2(myTicks);
+		SendPacket(NP_tick, sizeof(tick), tick);
+		mySentTicks = myTicks;
+	}
+	SendPacket(type, size, data);
+}
+
+/*
+ * Tell the opponent the piece moved this many columns: one packet, or
+ * a step at a time for a peer too old to know NP_shift.
+ */
+static void SendShift(int spied, int moved)
+{
+	netint2 data[1];
+
+	if (!spied || !moved)
+		return;
+	if (protocolVersion >= 4) {
+		data[0] = hton2((netint2)moved);
+		SendMove(NP_shift, sizeof(data), data);
+	}
+	else
+		for (; moved; moved += moved < 0 ? 1 : -1)
+			SendMove(moved < 0 ? NP_left : NP_right, 0, NULL);
 }
 
 ExtFunc void OneGame(int scr, int scr2)
 {
+	Board *me = &boards[scr], *them = scr2 >= 0 ? &boards[scr2] : NULL;
 	MyEvent event;
-	int linesCleared, changed = 0;
+	int linesCleared, changed = 0, urgent = 0, ready;
 	int spied = 0, spying = 0, dropMode = 0;
 	int oldPaused = 0, paused = 0, pausedByMe = 0, pausedByThem = 0;
 	long pauseTimeLeft;
@@ -103,13 +197,15 @@ ExtFunc void OneGame(int scr, int scr2)
 	char *p, *cmd;
 
 	myLinesCleared = opponentLinesCleared = 0;
+	myTicks = mySentTicks = 0;
 	speed = stepDownInterval;
 	ResetBaseTime();
-	InitBoard(scr);
+	InitBoard(me, &screenObserver, scr);
 	if (scr2 >= 0) {
 		spied = 1;
 		spying = 1;
-		InitBoard(scr2);
+		InitBoard(them, &screenObserver, scr2);
+		InitMirror(&theirs, them);
 		UpdateOpponentDisplay();
 	}
 	ClearStatus();
@@ -118,10 +214,10 @@ ExtFunc void OneGame(int scr, int scr2)
 	if (robotEnable) {
 		RobotCmd(0, "GameType %s\n", gameNames[gameType]);
 		RobotCmd(0, "BoardSize 0 %d %d\n",
-				boardVisible[scr], boardWidth[scr]);
+				me->visible, me->width);
 		if (scr2 >= 0) {
 			RobotCmd(0, "BoardSize 1 %d %d\n",
-					boardVisible[scr2], boardWidth[scr2]);
+					them->visible, them->width);
 			RobotCmd(0, "Opponent 1 %s %s\n", opponentName, opponentHost);
 			if (opponentFlags & SCF_usingRobot)
 				RobotCmd(0, "OpponentFlag 1 robot\n");
@@ -132,30 +228,41 @@ ExtFunc void OneGame(int scr, int scr2)
 		RobotCmd(0, "BeginGame\n");
 		RobotTimeStamp();
 	}
-	while (StartNewPiece(scr, ChooseOption(stdOptions))) {
+	while (StartNewPiece(me, ChooseShape(&stdTable, GameStream()))) {
 		if (robotEnable && !fairRobot)
 			RobotCmd(1, "NewPiece %d\n", ++pieceCount);
 		if (spied) {
 			short shapeNum;
 			netint2 data[1];
 
-			shapeNum = ShapeToNetNum(curShape[scr]);
+			shapeNum = ShapeToNetNum(me->curShape);
 			data[0] = hton2(shapeNum);
 			SendPacket(NP_newPiece, sizeof(data), data);
+			myTicks = mySentTicks = 0;
 		}
 		for (;;) {
-			changed = RefreshBoard(scr) || changed;
-			if (spying)
-				changed = RefreshBoard(scr2) || changed;
-			if (changed) {
+			/* The robot sees the boards through RefreshBoard, so it can't wait */
+			ready = FrameReady(urgent, changed || BoardDirty(me)
+				|| (spying && BoardDirty(them)));
+			if (ready || robotEnable) {
+				changed = RefreshBoard(me) || changed;
+				if (spying)
+					changed = RefreshBoard(them) || changed;
+			}
+			if (ready && changed) {
 				RefreshScreen();
 				changed = 0;
 			}
+			urgent = 0;
 			CheckNetConn();
 			switch (WaitMyEvent(&event, EM_any)) {
 				case E_alarm:
-					if (!MovePiece(scr, -1, 0))
+					if (localGravity && them && theirs.shape)
+						MovePiece(them, -1, 0);
+					if (!MovePiece(me, -1, 0))
 						goto nextPiece;
+					else if (localGravity)
+						++myTicks;
 					else if (spied)
 						SendPacket(NP_down, 0, NULL);
 					break;
@@ -170,6 +277,7 @@ ExtFunc void OneGame(int scr, int scr2)
 					}
 					if (!p)
 						break;
+					urgent = 1;		/* Our own keys show at once */
 				keyEvent:
 					if (paused) {
 						if (key == KT_quit)
@@ -179,44 +287,34 @@ ExtFunc void OneGame(int scr, int scr2)
 					}
 					switch(key) {
 						case KT_left:
-							if (MovePiece(scr, 0, -1) && spied)
-								SendPacket(NP_left, 0, NULL);
+							if (MovePiece(me, 0, -1) && spied)
+								SendMove(NP_left, 0, NULL);
 							break;
-						case KT_full_left: {
-							int i = 0;
-							for(;i < MAX_BOARD_WIDTH; i++){
-								if (MovePiece(scr, 0, -1) && spied)
-									SendPacket(NP_left, 0, NULL);
-							}
+						case KT_full_left:
+							SendShift(spied, ShiftPiece(me, -MAX_BOARD_WIDTH));
 							break;
-						}
 						case KT_right:
-							if (MovePiece(scr, 0, 1) && spied)
-								SendPacket(NP_right, 0, NULL);
+							if (MovePiece(me, 0, 1) && spied)
+								SendMove(NP_right, 0, NULL);
 							break;
-						case KT_full_right: {
-							int i = 0;
-							for(; i < MAX_BOARD_WIDTH; i++){
-								if (MovePiece(scr, 0, 1) && spied)
-									SendPacket(NP_right, 0, NULL);
-							}
+						case KT_full_right:
+							SendShift(spied, ShiftPiece(me, MAX_BOARD_WIDTH));
 							break;
-						}
 						case KT_rotate:
-							if (RotatePiece(scr) && spied)
-								SendPacket(NP_rotate, 0, NULL);
+							if (RotatePiece(me) && spied)
+								SendMove(NP_rotate, 0, NULL);
 							break;
 						case KT_down:
-							if (MovePiece(scr, -1, 0) && spied)
-								SendPacket(NP_down, 0, NULL);
+							if (MovePiece(me, -1, 0) && spied)
+								SendMove(NP_down, 0, NULL);
 							break;
 						case KT_toggleSpy:
 							spying = (!spying) && (scr2 >= 0);
 							break;
 						case KT_drop:
-							if (DropPiece(scr) > 0) {
+							if (DropPiece(me) > 0) {
 								if (spied)
-									SendPacket(NP_drop, 0, NULL);
+									SendMove(NP_drop, 0, NULL);
 								SetITimer(speed, speed);
 							}
 							dropMode = dropModeEnable;
@@ -254,9 +352,9 @@ ExtFunc void OneGame(int scr, int scr2)
 							break;
 
 					}
-					if (dropMode && DropPiece(scr) > 0) {
+					if (dropMode && DropPiece(me) > 0) {
 						if (spied)
-							SendPacket(NP_drop, 0, NULL);
+							SendMove(NP_drop, 0, NULL);
 						SetITimer(speed, speed);
 					}
 					break;
@@ -288,58 +386,27 @@ ExtFunc void OneGame(int scr, int scr2)
 							short column;
 
 							memcpy(data, event.u.net.data, sizeof(data[0]));
-							column = Random(0, boardWidth[scr]);
+							column = Random(0, me->width);
 							data[1] = hton2(column);
-							InsertJunk(scr, ntoh2(data[0]), column);
+							InsertJunk(me, ntoh2(data[0]), column);
 							if (spied)
-								SendPacket(NP_insertJunk, sizeof(data), data);
-							break;
-						}
-						case NP_newPiece:
-						{
-							short shapeNum;
-							netint2 data[1];
-
-							FreezePiece(scr2);
-							memcpy(data, event.u.net.data, sizeof(data));
-							shapeNum = ntoh2(data[0]);
-							StartNewPiece(scr2, NetNumToShape(shapeNum));
+								SendMove(NP_insertJunk, sizeof(data), data);
 							break;
 						}
-						case NP_down:
-							MovePiece(scr2, -1, 0);
-							break;
-						case NP_left:
-							MovePiece(scr2, 0, -1);
-							break;
-						case NP_right:
-							MovePiece(scr2, 0, 1);
-							break;
-						case NP_rotate:
-							RotatePiece(scr2);
-							break;
-						case NP_drop:
-							DropPiece(scr2);
-							break;
 						case NP_clear:
 							{
-								int cleared = ClearFullLines(scr2);
+								int cleared;
+
+								cleared = MirrorPacket(&theirs, event.u.net.type,
+									event.u.net.size, event.u.net.data);
 								if (cleared) {
 									opponentLinesCleared += cleared;
 									opponentTotalLinesCleared += cleared;
 									ShowDisplayInfo();
-									RefreshScreen();
+									changed = 1;
 								}
 							}
 							break;
-						case NP_insertJunk:
-						{
-							netint2 data[2];
-
-							memcpy(data, event.u.net.data, sizeof(data));
-							InsertJunk(scr2, ntoh2(data[0]), ntoh2(data[1]));
-							break;
-						}
 						case NP_pause:
 						{
 							netint2 data[1];
@@ -355,6 +422,8 @@ ExtFunc void OneGame(int scr, int scr2)
 							break;
 						}
 						default:
+							MirrorPacket(&theirs, event.u.net.type,
+								event.u.net.size, event.u.net.data);
 							break;
 					}
 					break;
@@ -375,21 +444,18 @@ ExtFunc void OneGame(int scr, int scr2)
 		}
 	nextPiece:
 		dropMode = 0;
-		FreezePiece(scr);
-		myLinesCleared += linesCleared = ClearFullLines(scr);
+		myLinesCleared += linesCleared = LandPiece(me);
 		myTotalLinesCleared += linesCleared;
 		if (linesCleared) {
 			ShowDisplayInfo();
-			RefreshScreen();
+			changed = 1;
 		}
 		if (linesCleared > 0 && spied)
 			SendPacket(NP_clear, 0, NULL);
-		if (gameType == GT_classicTwo && linesCleared > 1) {
-			short junkLines;
+		if (gameType == GT_classicTwo && JunkLines(linesCleared) > 0) {
 			netint2 data[1];
 
-			junkLines = linesCleared - (linesCleared < 4);
-			data[0] = hton2(junkLines);
+			data[0] = hton2(JunkLines(linesCleared));
 			SendPacket(NP_giveJunk, sizeof(data), data);
 		}
 	}
@@ -399,18 +465,99 @@ gameOver:
 	SetITimer(0, 0);
 }
 
+/*
+ * Watch a match on netrisd (-V).  The server starts us off with both
+ * boards, then passes on what each player sends, after an NP_player
+ * saying whose it is.
+ */
+static void WatchGame(char *hostStr, char *portStr, int match)
+{
+	Mirror mirrors[2];
+	char names[2][16];
+	MyEvent event;
+	netint4 id[1];
+	netint2 data[2];
+	int scr = 0, changed, i;
+
+	for (i = 0; i < 2; ++i) {
+		InitBoard(&boards[i], &screenObserver, i);
+		InitMirror(&mirrors[i], &boards[i]);
+		strcpy(names[i], "???");
+	}
+	PrintStatus("Connecting to server...");
+	RefreshScreen();
+	InitiateConnection(hostStr, portStr);
+	id[0] = hton4(match);
+	SendPacket(NP_watch, sizeof(id), id);
+	ClearStatus();
+	ShowWatching(names[0], names[1]);
+	for (;;) {
+		if (FrameReady(0, BoardDirty(&boards[0])
+				|| BoardDirty(&boards[1]))) {
+			for (i = changed = 0; i < 2; ++i)
+				changed = RefreshBoard(&boards[i]) || changed;
+			if (changed)
+				RefreshScreen();
+		}
+		CheckNetConn();
+		switch (WaitMyEvent(&event, EM_net | EM_key | EM_frame)) {
+			case E_key:
+				if (event.u.key == keyTable[KT_quit])
+					exit(0);
+				if (event.u.key == keyTable[KT_redraw])
+					ScheduleFullRedraw();
+				break;
+			case E_net:
+				switch (event.u.net.type) {
+					case NP_player:
+						memcpy(data, event.u.net.data, sizeof(data));
+						scr = ntoh2(data[0]) != 0;
+						if (ntoh2(data[1])) {
+							InitBoard(&boards[scr], &screenObserver, scr);
+							InitMirror(&mirrors[scr], &boards[scr]);
+						}
+						break;
+					case NP_userName:
+						strncpy(names[scr], event.u.net.data,
+							sizeof(names[scr]) - 1);
+						names[scr][sizeof(names[scr]) - 1] = 0;
+						for (i = 0; names[scr][i]; ++i)
+							if (!isprint(names[scr][i]))
+								names[scr][i] = '?';
+						ShowWatching(names[0], names[1]);
+						RefreshScreen();
+						break;
+					default:
+						MirrorPacket(&mirrors[scr], event.u.net.type,
+							event.u.net.size, event.u.net.data);
+						break;
+				}
+				break;
+			case E_lostConn:
+				return;
+			default:
+				break;
+		}
+	}
+}
+
 ExtFunc int main(int argc, char **argv)
 {
-	int ch, done = 0;
+	int ch, done = 0, watchMatch = -1;
 	char *hostStr = NULL, *portStr = NULL;
 	MyEvent event;
 	netType = NET_INVALID;
 
 	standoutEnable = colorEnable = 1;
 	stepDownInterval = DEFAULT_INTERVAL;
+	frameRate = DEFAULT_FRAME_RATE;
+	myFlags = SCF_localGravity;
 	MapKeys(DEFAULT_KEYS);
-	while ((ch = getopt(argc, argv, "hHRs:r:Fk:c:woDSCp:i:")) != -1)
+	while ((ch = getopt(argc, argv, "hHRs:r:Fk:c:woDSCAp:i:f:V:")) != -1)
 		switch (ch) {
+			case 'V':
+				watchMatch = atoi(optarg);
+				break;
 			case 'c':
 				netType = NET_CLIENT;
 				hostStr = optarg;
@@ -424,6 +571,9 @@ ExtFunc int main(int argc, char **argv)
 			case 'i':
 				stepDownInterval = atof(optarg) * 1e6;
 				break;
+			case 'f':
+				frameRate = atoi(optarg);
+				break;
 			case 's':
 				initSeed = atoi(optarg);
 				myFlags |= SCF_setSeed;
@@ -443,6 +593,9 @@ ExtFunc int main(int argc, char **argv)
 			case 'C':
 				colorEnable = 0;
 				break;
+			case 'A':
+				ansiEnable = 1;
+				break;
 			case 'S':
 				standoutEnable = 0;
 				break;
@@ -468,9 +621,28 @@ ExtFunc int main(int argc, char **argv)
 	}
 	if (fairRobot && !robotEnable)
 		fatal("You can't use the -F option without the -r option");
+	if (watchMatch >= 0 && netType != NET_CLIENT)
+		fatal("The -V option needs the server's name, given with -c");
 
 	InitUtil();
+	InitShapes();
 	InitScreens();
+	if (watchMatch >= 0) {
+		if (!portStr) {
+			sprintf(scratch, "%d", DEFAULT_WATCH_PORT);
+			portStr = scratch;
+		}
+		InitNet();
+		WatchGame(hostStr, portStr, watchMatch);
+		CloseNet();
+		CatchUpScreen(2);
+		PrintStatus("The match is over.  Press '%c' to quit.",
+			keyTable[KT_quit]);
+		RefreshScreen();
+		while (getchar() != keyTable[KT_quit])
+			;
+		return 0;
+	}
 	while(!done) {
 		if (robotEnable)
 			InitRobot(robotProg);
@@ -479,8 +651,8 @@ ExtFunc int main(int argc, char **argv)
 			SRandom(time(0));
 		if (netType != NET_INVALID) {
 			gameType = GT_classicTwo;
-			InitBoard(0);
-			InitBoard(1);
+			InitBoard(&boards[0], &screenObserver, 0);
+			InitBoard(&boards[1], &screenObserver, 1);
 			PrintStatus(netType == NET_CLIENT
 						? "Connecting to opponent..."
 						: "Waiting for opponent..."); 
@@ -511,6 +683,9 @@ ExtFunc int main(int argc, char **argv)
 						  "of Netris.  Get the latest version.");
 				if (protocolVersion > PROTOCOL_VERSION)
 					protocolVersion = PROTOCOL_VERSION;
+				if (protocolVersion >= 5)
+					UseCompactFraming();
+				UseLegacyRandom(protocolVersion < 6);
 			}
 			if (protocolVersion < 3 && stepDownInterval != DEFAULT_INTERVAL)
 				fatal("Your opponent's version of Netris predates the -i option.\n"
@@ -540,6 +715,7 @@ ExtFunc int main(int argc, char **argv)
 				memcpy(data, event.u.net.data, len);
 				opponentFlags = ntoh4(data[0]);
 				seed = ntoh4(data[1]);
+				localGravity = (myFlags & opponentFlags & SCF_localGravity) != 0;
 				if (netType == NET_CLIENT) {
 					if ((opponentFlags & SCF_setSeed) != (myFlags & SCF_setSeed))
 						fatal("If one player sets the random number seed, "
@@ -580,12 +756,14 @@ ExtFunc int main(int argc, char **argv)
 						opponentHost[i] = '?';
 			}
 			OneGame(0, 1);
+			CatchUpScreen(2);
 			InvertScreen(0);
 			InvertScreen(1);
 		}
 		else {
 			gameType = GT_onePlayer;
 			OneGame(0, -1);
+			CatchUpScreen(1);
 			InvertScreen(0);
 			RefreshScreen();
 		}
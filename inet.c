@@ -27,27 +27,73 @@
 #include <netdb.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #define HEADER_SIZE sizeof(netint2[2])
+#define MAX_PACKET_SIZE 64
 
 static MyEventType NetGenFunc(EventGenRec *gen, MyEvent *event);
 
 static int sock = -1;
 static EventGenRec netGen = { NULL, 0, FT_read, -1, NetGenFunc, EM_net };
 
-static char netBuf[64];
-static int netBufSize, netBufGoal = HEADER_SIZE;
+static char netBuf[4096];
+static int netBufStart, netBufEnd;	/* The bytes we've yet to look at */
 static int lostConn, gotEndConn;
 
+/* Packets from SendPacket(), waiting for FlushNet() to write them at once */
+static unsigned char outBuf[4096];
+static int outBufSize;
+
+/*
+ * Protocol 5's compact framing, used once both ends have said they can.
+ * Each packet starts with one opcode byte:
+ *
+ *   000ccccc .. 100ccccc	down, left, right, rotate or drop, c+1 times
+ *   101ttttt n f1..fn		packet type t whose data is n netint2s
+ *   110ttttt len data		packet type t with len bytes of other data
+ *
+ * with n, the fields and len all unsigned varints: 7 bits a byte, low
+ * bits first, the top bit set on all but the last byte.
+ */
+#define OP_RUN_MAX		32
+#define OP_SHORTS		0xa0
+#define OP_BYTES		0xc0
+
+static NetPacketType runTypes[] = { NP_down, NP_left, NP_right,
+									NP_rotate, NP_drop };
+#define NUM_RUN_TYPES	(sizeof(runTypes) / sizeof(runTypes[0]))
+
+static int compact;
+static int runPos = -1;			/* outBuf offset of the last run opcode */
+static NetPacketType runType;	/* Received, and still to be handed out */
+static int runLeft;
+static netint2 shorts[MAX_PACKET_SIZE / 2];
+
 EXT int netType;
 
 ExtFunc void InitNet(void)
 {
 	lostConn = 0;
 	gotEndConn = 0;
+	outBufSize = 0;
+	netBufStart = netBufEnd = 0;
+	compact = runLeft = 0;
+	runPos = -1;
 	AtExit(CloseNet);
 }
 
+static void SetNonBlocking(int fd)
+{
+	int status;
+
+	if ((status = fcntl(fd, F_GETFL, 0)) < 0)
+		die("fcntl/F_GETFL");
+	status |= O_NONBLOCK;
+	if (fcntl(fd, F_SETFL, status) < 0)
+		die("fcntl/F_SETFL");
+}
+
 ExtFunc int WaitForConnection(char *portStr)
 {
 	struct sockaddr_in addr;
@@ -85,6 +131,7 @@ ExtFunc int WaitForConnection(char *portStr)
 	val2.l_linger = 0;
 	setsockopt(sock, SOL_SOCKET, SO_LINGER,
 			(void *)&val2, sizeof(val2));
+	SetNonBlocking(sock);
 	netGen.fd = sock;
 	strcpy(opponentHost, "???");
 	if (addr.sin_family == AF_INET) {
@@ -131,44 +178,180 @@ ExtFunc int InitiateConnection(char *hostStr, char *portStr)
 		sleep(1);
 		goto again;
 	}
+	SetNonBlocking(mySock);
 	netGen.fd = sock = mySock;
 	AddEventGen(&netGen);
 	return 0;
 }
 
-static MyEventType NetGenFunc(EventGenRec *gen, MyEvent *event)
+ExtFunc void UseCompactFraming(void)
 {
-	int result;
-	short type, size;
-	netint2 data[2];
+	compact = 1;
+}
 
-	result = MyRead(sock, netBuf + netBufSize, netBufGoal - netBufSize);
-	if (result < 0) {
-		lostConn = 1;
-		return E_lostConn;
+/* Packets whose data is all netint2, so can go as varints */
+static int ShortsPacket(NetPacketType type)
+{
+	return type == NP_giveJunk || type == NP_newPiece || type == NP_insertJunk
+		|| type == NP_pause || type == NP_shift || type == NP_tick;
+}
+
+static int PutVarint(unsigned char *p, unsigned int value)
+{
+	int len = 0;
+
+	while (value >= 0x80) {
+		p[len++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	p[len++] = value;
+	return len;
+}
+
+/* Bytes used, or 0 if they haven't all arrived */
+static int GetVarint(unsigned char *p, unsigned char *end, unsigned int *value)
+{
+	int len = 0, shift = 0;
+
+	*value = 0;
+	do {
+		if (p + len >= end)
+			return 0;
+		if (len == 3)
+			fatal("Received an invalid packet (bad number)");
+		*value |= (p[len] & 0x7f) << shift;
+		shift += 7;
+	} while (p[len++] & 0x80);
+	return len;
+}
+
+/*
+ * Decode the packet at the front of netBuf into event.  Returns its size,
+ * or 0 if we don't have all of it yet.
+ */
+static int CompactPacket(MyEvent *event)
+{
+	unsigned char *start = (unsigned char *)netBuf + netBufStart;
+	unsigned char *end = (unsigned char *)netBuf + netBufEnd, *p = start;
+	unsigned int op, count, value, i;
+	int len;
+
+	if (p >= end)
+		return 0;
+	op = *p++;
+	if (op < NUM_RUN_TYPES * OP_RUN_MAX) {
+		runType = event->u.net.type = runTypes[op / OP_RUN_MAX];
+		runLeft = op % OP_RUN_MAX;
+		event->u.net.size = 0;
+		event->u.net.data = NULL;
+		return 1;
+	}
+	if ((op & 0xe0) != OP_SHORTS && (op & 0xe0) != OP_BYTES)
+		fatal("Received an invalid packet (bad opcode)");
+	if (!(len = GetVarint(p, end, &count)))
+		return 0;
+	p += len;
+	if ((op & 0xe0) == OP_BYTES) {
+		if (count >= MAX_PACKET_SIZE)
+			fatal("Received an invalid packet (too large)");
+		if (end - p < count)
+			return 0;
+		event->u.net.data = p;
+		p += count;
+	}
+	else {
+		if (count > sizeof(shorts) / sizeof(shorts[0]))
+			fatal("Received an invalid packet (too large)");
+		for (i = 0; i < count; ++i) {
+			if (!(len = GetVarint(p, end, &value)))
+				return 0;
+			if (value > 0xffff)
+				fatal("Received an invalid packet (bad number)");
+			shorts[i] = hton2(value);
+			p += len;
+		}
+		event->u.net.data = shorts;
+		count *= sizeof(netint2);
 	}
-	netBufSize += result;
-	if (netBufSize < netBufGoal)
-		return E_none;
-	memcpy(data, netBuf, sizeof(data));
-	type = ntoh2(data[0]);
+	event->u.net.type = op & 0x1f;
+	event->u.net.size = count;
+	return p - start;
+}
+
+/*
+ * Decode the packet at the front of netBuf into event.  Returns its size,
+ * or 0 if we don't have all of it yet.
+ */
+static int NextPacket(MyEvent *event)
+{
+	netint2 data[2];
+	int size;
+
+	if (compact)
+		return CompactPacket(event);
+	if (netBufEnd - netBufStart < HEADER_SIZE)
+		return 0;
+	memcpy(data, netBuf + netBufStart, sizeof(data));
 	size = ntoh2(data[1]);
-	if (size >= sizeof(netBuf))
+	if (size >= MAX_PACKET_SIZE)
 		fatal("Received an invalid packet (too large), possibly an attempt\n"
 			  "  to exploit a vulnerability in versions before 0.52 !");
-	netBufGoal = size;
-	if (netBufSize < netBufGoal)
-		return E_none;
-	netBufSize = 0;
-	netBufGoal = HEADER_SIZE;
-	event->u.net.type = type;
+	if (size < HEADER_SIZE)
+		fatal("Received an invalid packet (too small)");
+	if (netBufEnd - netBufStart < size)
+		return 0;
+	event->u.net.type = ntoh2(data[0]);
 	event->u.net.size = size - HEADER_SIZE;
-	event->u.net.data = netBuf + HEADER_SIZE;
-	if (type == NP_endConn) {
+	event->u.net.data = netBuf + netBufStart + HEADER_SIZE;
+	return size;
+}
+
+/*
+ * One read() takes whatever has arrived, often several packets.  They're
+ * handed out one per call, with netGen.ready set while any bytes are left.
+ * They're only parsed as they go out, since the framing can change after
+ * NP_version; if the rest turns out to be half a packet, the read() that
+ * follows just finds nothing more.
+ */
+static MyEventType NetGenFunc(EventGenRec *gen, MyEvent *event)
+{
+	int result, size;
+
+	if (runLeft > 0) {
+		--runLeft;
+		event->u.net.type = runType;
+		event->u.net.size = 0;
+		event->u.net.data = NULL;
+		netGen.ready = runLeft > 0 || netBufEnd > netBufStart;
+		return E_net;
+	}
+	if (!(size = NextPacket(event))) {
+		if (netBufStart > 0) {
+			memmove(netBuf, netBuf + netBufStart, netBufEnd - netBufStart);
+			netBufEnd -= netBufStart;
+			netBufStart = 0;
+		}
+		do {
+			result = read(sock, netBuf + netBufEnd,
+					sizeof(netBuf) - netBufEnd);
+		} while (result < 0 && errno == EINTR);
+		if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return E_none;
+		if (result <= 0) {
+			lostConn = 1;
+			return E_lostConn;
+		}
+		netBufEnd += result;
+		if (!(size = NextPacket(event)))
+			return E_none;
+	}
+	netBufStart += size;
+	netGen.ready = runLeft > 0 || netBufEnd > netBufStart;
+	if (event->u.net.type == NP_endConn) {
 		gotEndConn = 1;
 		return E_lostConn;
 	}
-	else if (type == NP_byeBye) {
+	else if (event->u.net.type == NP_byeBye) {
 		lostConn = 1;
 		return E_lostConn;
 	}
@@ -179,16 +362,92 @@ ExtFunc void CheckNetConn(void)
 {
 }
 
+static void SendCompact(NetPacketType type, int size, void *data)
+{
+	unsigned char pkt[8 + 3 * MAX_PACKET_SIZE];
+	netint2 field;
+	int len = 0, op, i;
+
+	for (op = 0; op < NUM_RUN_TYPES && runTypes[op] != type; ++op)
+		;
+	if (op < NUM_RUN_TYPES && size == 0) {
+		if (runPos >= 0 && runPos == outBufSize - 1
+				&& outBuf[runPos] / OP_RUN_MAX == op
+				&& outBuf[runPos] % OP_RUN_MAX < OP_RUN_MAX - 1) {
+			++outBuf[runPos];
+			return;
+		}
+		pkt[len++] = op * OP_RUN_MAX;
+	}
+	else if (ShortsPacket(type) && size % sizeof(netint2) == 0) {
+		pkt[len++] = OP_SHORTS | type;
+		len += PutVarint(pkt + len, size / sizeof(netint2));
+		for (i = 0; i < size; i += sizeof(netint2)) {
+			memcpy(&field, (char *)data + i, sizeof(field));
+			len += PutVarint(pkt + len, ntoh2(field));
+		}
+	}
+	else {
+		pkt[len++] = OP_BYTES | type;
+		len += PutVarint(pkt + len, size);
+		memcpy(pkt + len, data, size);
+		len += size;
+	}
+	if (outBufSize + len > sizeof(outBuf))
+		FlushNet();
+	memcpy(outBuf + outBufSize, pkt, len);
+	runPos = pkt[0] < OP_SHORTS ? outBufSize : -1;
+	outBufSize += len;
+}
+
 ExtFunc void SendPacket(NetPacketType type, int size, void *data)
 {
 	netint2 header[2];
 
+	if (!data)
+		size = 0;
+	assert(size + HEADER_SIZE < MAX_PACKET_SIZE);
+	if (compact) {
+		SendCompact(type, size, data);
+		return;
+	}
+	if (outBufSize + size + HEADER_SIZE > sizeof(outBuf))
+		FlushNet();
 	header[0] = hton2(type);
 	header[1] = hton2(size + HEADER_SIZE);
-	if (MyWrite(sock, header, HEADER_SIZE) != HEADER_SIZE)
-		die("write");
-	if (size > 0 && data && MyWrite(sock, data, size) != size)
-		die("write");
+	memcpy(outBuf + outBufSize, header, HEADER_SIZE);
+	outBufSize += HEADER_SIZE;
+	if (size > 0) {
+		memcpy(outBuf + outBufSize, data, size);
+		outBufSize += size;
+	}
+}
+
+/*
+ * Called by WaitMyEvent() before it blocks, and on the way out.  The
+ * socket's non-blocking, so if it's full we wait for room here.
+ */
+ExtFunc void FlushNet(void)
+{
+	int size = outBufSize, done = 0, result;
+	fd_set fds;
+
+	if (size == 0 || sock < 0)
+		return;
+	outBufSize = 0;
+	runPos = -1;
+	while (done < size) {
+		result = write(sock, outBuf + done, size - done);
+		if (result > 0)
+			done += result;
+		else if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			FD_ZERO(&fds);
+			FD_SET(sock, &fds);
+			select(sock + 1, NULL, &fds, NULL, NULL);
+		}
+		else if (result == 0 || errno != EINTR)
+			die("write");
+	}
 }
 
 ExtFunc void CloseNet(void)
@@ -208,11 +467,14 @@ ExtFunc void CloseNet(void)
 				SendPacket(NP_byeBye, 0, NULL);
 			}
 		}
-		close(sock);
-		sock = -1;
+		FlushNet();
 	}
 	if (netGen.next)
 		RemoveEventGen(&netGen);
+	if (sock >= 0) {
+		close(sock);
+		sock = -1;
+	}
 }
 
 /*
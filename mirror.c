@@ -0,0 +1,186 @@
+/*
+ * Netris -- A free networked version of T*tris
+ * Copyright (C) 1994-2016  Mark H. Weaver et al
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include "netris.h"
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <string.h>
+
+/*
+ * A Mirror plays someone else's board from the packets they send: the
+ * opponent's board in a game, both boards in netrisd and when watching.
+ *
+ * With SCF_localGravity the receiver may move the piece down on its own
+ * between packets, for show.  The mirror keeps the piece where the
+ * packets put it, and starts from there for every packet.  A piece that
+ * has landed is dropped from there: nothing but gravity can have moved
+ * it since.  Without local gravity that drop never moves anything.
+ */
+
+ExtFunc void InitMirror(Mirror *m, Board *b)
+{
+	memset(m, 0, sizeof(*m));
+	m->board = b;
+}
+
+/* Back to where the packets say the piece is */
+ExtFunc void MirrorPiece(Mirror *m)
+{
+	if (m->shape)
+		PlacePiece(m->board, m->shape, m->y, m->x);
+}
+
+static void SavePiece(Mirror *m)
+{
+	m->shape = m->board->curShape;
+	m->y = m->board->curY;
+	m->x = m->board->curX;
+}
+
+/* The piece has come to rest, though nobody said where */
+static void SettlePiece(Mirror *m)
+{
+	if (m->shape) {
+		MirrorPiece(m);
+		DropPiece(m->board);
+		m->shape = NULL;
+	}
+}
+
+/* NetNumToShape, for numbers that may have come from anyone */
+static Shape *PacketShape(netint2 num)
+{
+	int i;
+
+	for (i = 0; netMapping[i]; ++i)
+		if (i == ntoh2(num))
+			return netMapping[i];
+	return NULL;
+}
+
+/*
+ * Play one packet; returns the number of lines it cleared.  Packets that
+ * don't change the board, or that are too short, are ignored.
+ */
+ExtFunc int MirrorPacket(Mirror *m, NetPacketType type, int size, void *data)
+{
+	Board *b = m->board;
+	netint2 args[MAX_BOARD_WIDTH / 2 + 1];
+	Shape *shape;
+	BlockType block;
+	int i, y;
+
+	if (size > sizeof(args))
+		size = sizeof(args);
+	memcpy(args, data, size);
+	switch (type) {
+		case NP_newPiece:
+			if (size < sizeof(netint2) || !(shape = PacketShape(args[0])))
+				break;
+			SettlePiece(m);
+			FreezePiece(b);
+			StartNewPiece(b, shape);
+			SavePiece(m);
+			m->ticks = 0;
+			break;
+		case NP_clear:
+			SettlePiece(m);
+			return ClearFullLines(b);
+		case NP_insertJunk:
+			if (size < sizeof(netint2[2]) || ntoh2(args[1]) >= b->width)
+				break;
+			MirrorPiece(m);
+			InsertJunk(b, ntoh2(args[0]), ntoh2(args[1]));
+			if (m->shape)
+				SavePiece(m);
+			break;
+		case NP_snapshot:
+			/* One line of settled blocks: y, then a byte per column */
+			if (size < sizeof(netint2) + b->width ||
+					(y = ntoh2(args[0])) >= b->height)
+				break;
+			for (i = 0; i < b->width; ++i) {
+				block = ((BlockType *)data)[sizeof(netint2) + i];
+				SetBlock(b, y, i, block > 0 && block < BT_wall ? block : BT_none);
+			}
+			break;
+		case NP_place:
+			/*
+			 * The falling piece: shape, y, x, and how many of its
+			 * NP_ticks y already has in it
+			 */
+			if (size < sizeof(netint2[3]) || !(shape = PacketShape(args[0])))
+				break;
+			PlacePiece(b, shape, (short)ntoh2(args[1]), (short)ntoh2(args[2]));
+			SavePiece(m);
+			m->ticks = size < sizeof(netint2[4]) ? 0 : ntoh2(args[3]);
+			break;
+		default:
+			break;
+	}
+	if (!m->shape)
+		return 0;
+	switch (type) {
+		case NP_tick:
+			if (size < sizeof(netint2))
+				break;
+			MirrorPiece(m);
+			for (; m->ticks < ntoh2(args[0]); ++m->ticks)
+				MovePiece(b, -1, 0);
+			SavePiece(m);
+			break;
+		case NP_down:
+			MirrorPiece(m);
+			MovePiece(b, -1, 0);
+			SavePiece(m);
+			break;
+		case NP_left:
+		case NP_right:
+			MirrorPiece(m);
+			MovePiece(b, 0, type == NP_left ? -1 : 1);
+			SavePiece(m);
+			break;
+		case NP_shift:
+			if (size < sizeof(netint2))
+				break;
+			MirrorPiece(m);
+			ShiftPiece(b, (short)ntoh2(args[0]));
+			SavePiece(m);
+			break;
+		case NP_rotate:
+			MirrorPiece(m);
+			RotatePiece(b);
+			SavePiece(m);
+			break;
+		case NP_drop:
+			MirrorPiece(m);
+			DropPiece(b);
+			SavePiece(m);
+			break;
+		default:
+			break;
+	}
+	return 0;
+}
+
+/*
+ * vi: ts=4 ai
+ * vim: noai si
+ */
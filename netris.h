@@ -64,28 +64,33 @@ typedef uint32_t netint4;
 #define ntoh4(x) ntohl(x)
 
 #define DEFAULT_PORT 9284	/* Very arbitrary */
+#define DEFAULT_WATCH_PORT 9285	/* netrisd's port for spectators */
 
 /* Protocol versions */
 #define MAJOR_VERSION		1	
-#define PROTOCOL_VERSION	3
+#define PROTOCOL_VERSION	6
 #define ROBOT_VERSION		1
 
 #define MAX_BOARD_WIDTH		32
 #define MAX_BOARD_HEIGHT	64
 #define MAX_SCREENS			2
+#define MAX_SHAPE_CELLS		4
 
 #define DEFAULT_INTERVAL	300000	/* Step-down interval in microseconds */
+#define DEFAULT_FRAME_RATE	30		/* Most frames a second, but see -f */
 
 /* NP_startConn flags */
 #define SCF_usingRobot		000001
 #define SCF_fairRobot		000002
 #define SCF_setSeed			000004
+#define SCF_localGravity	000010
 
 /* Event masks */
 #define EM_alarm			000001
 #define EM_key				000002
 #define EM_net				000004
 #define EM_robot			000010
+#define EM_frame			000020
 #define EM_any				000777
 
 #define DEFAULT_KEYS "jJklL mspf^lnq "
@@ -115,15 +120,22 @@ typedef enum _Dir { D_down, D_right, D_up, D_left } Dir;
 typedef enum _Cmd { C_end, C_forw, C_back, C_left, C_right, C_plot } Cmd;
 typedef enum _FDType { FT_read, FT_write, FT_except, FT_len } FDType;
 typedef enum _MyEventType { E_none, E_alarm, E_key, E_net,
-							E_lostConn, E_robot, E_lostRobot } MyEventType;
+							E_lostConn, E_robot, E_lostRobot,
+							E_frame } MyEventType;
 typedef enum _NetPacketType { NP_endConn, NP_giveJunk, NP_newPiece,
 							NP_down, NP_left, NP_right,
 							NP_rotate, NP_drop, NP_clear,
 							NP_insertJunk, NP_startConn,
 							NP_userName, NP_pause, NP_version,
-							NP_byeBye } NetPacketType;
+							NP_byeBye, NP_shift, NP_tick,
+							NP_watch, NP_player, NP_snapshot,
+							NP_place } NetPacketType;
 
 typedef signed char BlockType;
+typedef uint32_t BoardRow;	/* One bit per column, MAX_BOARD_WIDTH wide */
+
+#define ROW_MASK(width) \
+	((width) >= 32 ? ~(BoardRow)0 : ((BoardRow)1 << (width)) - 1)
 
 typedef struct _MyEvent {
 	MyEventType type;
@@ -151,6 +163,7 @@ typedef struct _EventGenRec {
 	int fd;
 	EventGenFunc func;
 	int mask;
+	int armed;			/* What we've asked the kernel to watch for; util.c */
 } EventGenRec;
 
 typedef struct _Shape {
@@ -159,6 +172,13 @@ typedef struct _Shape {
 	Dir initDir;
 	BlockType type;
 	Cmd *cmds;
+
+	/* Compiled from cmds by InitShapes(), relative to (initY, initX) */
+	int numCells;
+	int cellY[MAX_SHAPE_CELLS], cellX[MAX_SHAPE_CELLS];
+	int minY, minX, maxX, height;
+	BoardRow rowMask[MAX_SHAPE_CELLS];	/* Row minY + i, bit 0 at minX */
+	int colBottom[MAX_SHAPE_CELLS];		/* Lowest cellY in column minX + i */
 } Shape;
 
 typedef struct _ShapeOption {
@@ -166,7 +186,117 @@ typedef struct _ShapeOption {
 	Shape *shape;
 } ShapeOption;
 
-typedef int (*ShapeDrawFunc)(int scr, int y, int x,
+/* A ShapeOption list made ready for choosing in O(1); see shapes.c */
+#define MAX_SHAPE_OPTIONS	16
+
+typedef struct _ShapeTable {
+	ShapeOption *options;
+	int count;
+	uint64_t keep[MAX_SHAPE_OPTIONS];	/* Odds of i over its alias, in 2^-32 */
+	int alias[MAX_SHAPE_OPTIONS];
+} ShapeTable;
+
+/* A stream of random numbers; see rand.c */
+typedef struct _RandStream {
+	uint64_t s[4];			/* xoshiro256** */
+	int legacy, lcg;		/* The 15-bit generator of protocol 5 and older */
+} RandStream;
+
+struct _Board;
+
+/*
+ * Hooks for whoever wants to watch a board, usually to draw it.  Any of
+ * them may be NULL.  RefreshBoard() calls rowUpdate before plotting each
+ * changed line, and refreshed once it's done.
+ */
+typedef struct _BoardObserver {
+	void (*init)(struct _Board *b);
+	void (*cleanup)(struct _Board *b);
+	void (*rowUpdate)(struct _Board *b, int y, BlockType *row);
+	void (*plotBlock)(struct _Board *b, int y, int x, BlockType type);
+	void (*plotUnderline)(struct _Board *b, int x, int flag);
+	void (*refreshed)(struct _Board *b);
+} BoardObserver;
+
+/*
+ * One player's board and falling piece.  Everything the game rules need
+ * is in here; the rows are stored bottom line first.
+ */
+typedef struct _Board {
+	BoardObserver *observer;	/* NULL for a headless board */
+	int scr;				/* Screen or player number, for the observer */
+	int height, visible, width;
+	BoardRow fullRow;
+
+	/* Occupancy and block types, by physical row; see board.c */
+	BoardRow rows[MAX_BOARD_HEIGHT];
+	BlockType block[MAX_BOARD_HEIGHT][MAX_BOARD_WIDTH];
+	int rowMap[MAX_BOARD_HEIGHT];
+	int colTop[MAX_BOARD_WIDTH];	/* One past the highest settled block */
+
+	/* What's on the screen, by board line */
+	BlockType oldBlock[MAX_BOARD_HEIGHT][MAX_BOARD_WIDTH];
+	unsigned int changed[MAX_BOARD_HEIGHT];
+	int falling[MAX_BOARD_WIDTH], oldFalling[MAX_BOARD_WIDTH];
+
+	Shape *curShape;
+	int curY, curX;
+	int pieceCells;
+	int pieceY[MAX_SHAPE_CELLS], pieceX[MAX_SHAPE_CELLS];
+} Board;
+
+/* A board played from someone else's packets; see mirror.c */
+typedef struct _Mirror {
+	Board *board;
+	Shape *shape;			/* Where the packets last put the piece */
+	int y, x, ticks;
+} Mirror;
+
+/* What the embedded sample robot has decided about one board's piece;
+ * sr.c has its own copy of this, as it doesn't include netris.h */
+typedef struct _RobotState {
+	int pieceState;				/* 0 until decided */
+	int leftDest;
+	int pieceDest[4][4];
+	long decisions;				/* How many times it's decided */
+} RobotState;
+
+/* What draws the screen, on the render thread; see render.c */
+typedef struct _RenderBackend {
+	void (*init)(void);
+	void (*cleanup)(void);
+	void (*text)(int y, int x, char *s, int eol);	/* eol: clear the rest */
+	void (*block)(int y, int x, BlockType type);	/* Two columns wide */
+	void (*invert)(int y, int x, int width);		/* Reverse the blocks */
+	void (*present)(int y, int x);					/* Cursor at y, x */
+	void (*redraw)(void);		/* Next present redraws everything */
+} RenderBackend;
+
+/* Timers on a hierarchical wheel; see timer.c */
+#define WHEEL_BITS			6
+#define WHEEL_SLOTS			(1 << WHEEL_BITS)
+#define WHEEL_LEVELS		4
+#define TICK_NSEC			1000000
+
+struct _Timer;
+typedef void (*TimerFunc)(struct _Timer *t);
+
+typedef struct _Timer {
+	struct _Timer *next, **pprev;	/* pprev is NULL unless armed */
+	struct _TimerWheel *wheel;
+	int64_t when;					/* Deadline, in ticks */
+	int level, slot;
+	TimerFunc func;
+	void *data;
+} Timer;
+
+typedef struct _TimerWheel {
+	int64_t now;					/* Ticks before this one have run */
+	uint64_t used[WHEEL_LEVELS];	/* Which slots have timers */
+	Timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} TimerWheel;
+
+typedef int (*ShapeDrawFunc)(Board *b, int y, int x,
 					BlockType type, void *data);
 
 enum NetType {
@@ -183,26 +313,33 @@ enum States {
 };
 
 EXT GameType gameType;
-EXT int boardHeight[MAX_SCREENS];
-EXT int boardVisible[MAX_SCREENS], boardWidth[MAX_SCREENS];
-EXT Shape *curShape[MAX_SCREENS];
-EXT int curY[MAX_SCREENS], curX[MAX_SCREENS];
 EXT char opponentName[16], opponentHost[256];
-EXT int standoutEnable, colorEnable;
+EXT int standoutEnable, colorEnable, ansiEnable;
 EXT int robotEnable, robotVersion, fairRobot;
 EXT int protocolVersion;
 
 EXT int initSeed;
 EXT uint32_t stepDownInterval, speed;
+EXT int frameRate;
 
 EXT int myFlags, opponentFlags;
 
 EXT int won, lost;
+
+/* How late the gravity ticks of this game were handled; see util.c */
+typedef struct _Lateness {
+	long ticks, missed;			/* missed: ticks that came too late to count */
+	int64_t total, worst;		/* Nanoseconds */
+} Lateness;
+
+EXT Lateness lateness;
 EXT enum States gameState;
 
 EXT char scratch[1024];
 
 extern ShapeOption stdOptions[];
+extern ShapeTable stdTable;
+extern Shape *netMapping[];
 extern char *version_string;
 
 EXT int myLinesCleared;
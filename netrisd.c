@@ -0,0 +1,978 @@
+/*
+ * Netris -- A free networked version of T*tris
+ * Copyright (C) 1994-2016  Mark H. Weaver et al
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * netrisd: a match server.  Players connect with "netris -c host" as
+ * usual; each two that arrive in turn are paired into a match, and the
+ * server relays their packets to each other.  The main thread accepts
+ * and pairs; each match is then handed to one of a set of worker
+ * threads (one per CPU by default), each with its own epoll loop.
+ *
+ * The relay speaks the version 3 framing, so it tells both players the
+ * other speaks protocol 4 at most.  It also gives both players the same
+ * random seed, since each of them takes the seed the other sends, and
+ * turns off SCF_localGravity: spectators don't run gravity, so they need
+ * the players to send every step down.
+ *
+ * Spectators ("netris -V") connect to a second port and send NP_watch
+ * with a match number, 0 for the newest.  The server plays both boards
+ * of every match with Mirrors, so it can start a spectator off with a
+ * snapshot of them.  After that, each batch of packets a player sends
+ * is encoded once, into a Chunk, and every spectator's queue points at
+ * that same Chunk.  A spectator whose queue fills up is sent a fresh
+ * snapshot in place of what it missed, or dropped if it hasn't read
+ * anything since the last one.
+ *
+ * Each worker keeps a timer wheel, with a timer per match that ends it
+ * when neither player has sent anything for a while, and one per
+ * spectator still being sent the end of a match, which gives up on it
+ * if it stops reading.
+ */
+
+#include "netris.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#define HEADER_SIZE			sizeof(netint2[2])
+#define MAX_PACKET_SIZE		64
+#define RELAY_VERSION		4		/* Newest protocol we can relay */
+#define IN_BUF_SIZE			4096
+#define MAX_OUT_BUF			65536	/* More than this queued, and they're gone */
+#define MAX_EVENTS			256
+#define MAX_CHUNKS			64		/* Queued for a spectator before a resync */
+#define MAX_PENDING			64		/* Spectators yet to say what to watch */
+#define MAX_IOV				16
+#define DEFAULT_IDLE		900		/* Seconds without a packet, or 0 */
+#define DRAIN_TIME			30		/* Seconds to send the end of a match */
+
+enum { K_player, K_watcher };		/* The first field of Conn and Watcher */
+
+struct _Match;
+struct _Worker;
+
+typedef struct _Conn {
+	int kind;
+	struct _Match *match;
+	struct _Conn *peer;
+	int fd, scr;
+	char in[IN_BUF_SIZE];
+	int inSize;
+	char *out;
+	int outSize, outAlloc, wantOut;
+} Conn;
+
+/* Packets encoded once for any number of spectators; see QueueChunk */
+typedef struct _Chunk {
+	int refs, size;
+	char data[1];
+} Chunk;
+
+typedef struct _Watcher {
+	int kind;
+	struct _Watcher *next;		/* In the match's list, or the dead list */
+	struct _Match *match;		/* NULL once the match is over */
+	struct _Worker *worker;
+	Timer drain;				/* Armed once the match is over */
+	int fd;
+	Chunk *queue[MAX_CHUNKS];
+	int first, count, offset;	/* offset: how much of the first is written */
+	int wantOut, stalled, dead;
+} Watcher;
+
+typedef struct _Match {
+	struct _Match *next;		/* In the worker's live or dead list */
+	struct _Worker *worker;
+	Timer idle;
+	Conn conn[2];
+	Board board[2];
+	Mirror mirror[2];
+	char name[2][16];
+	Watcher *watchers;
+	int lastScr;				/* Whose packets spectators got last */
+	int id, dead;
+	int gotSeed;
+	netint4 seed;				/* The first seed either side sent */
+} Match;
+
+/* What the acceptor sends a worker: a match, or a spectator for one */
+typedef struct _WakeMsg {
+	Match *match;
+	int fd, id;
+} WakeMsg;
+
+typedef struct _Worker {
+	pthread_t thread;
+	int epfd;
+	int wake[2];
+	Match *live, *dead;
+	Watcher *deadWatchers;
+	TimerWheel timers;
+	int64_t now;				/* When epoll_wait last returned */
+} Worker;
+
+static Worker *workers;
+static int numWorkers, verbose;
+static int64_t idleTime = DEFAULT_IDLE * (int64_t)1000000000;
+
+static void Log(char *fmt, ...)
+{
+	va_list args;
+
+	if (!verbose)
+		return;
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+static void Fail(char *msg)
+{
+	perror(msg);
+	exit(1);
+}
+
+static void SetNonBlocking(int fd)
+{
+	int status;
+
+	if ((status = fcntl(fd, F_GETFL, 0)) < 0)
+		Fail("fcntl/F_GETFL");
+	if (fcntl(fd, F_SETFL, status | O_NONBLOCK) < 0)
+		Fail("fcntl/F_SETFL");
+}
+
+static void Watch(Worker *w, int fd, void *ptr, int op, int out)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | (out ? EPOLLOUT : 0);
+	ev.data.ptr = ptr;
+	if (epoll_ctl(w->epfd, op, fd, &ev) < 0)
+		Fail("epoll_ctl");
+}
+
+static void WatchConn(Worker *w, Conn *c, int op)
+{
+	Watch(w, c->fd, c, op, c->outSize > 0);
+	c->wantOut = c->outSize > 0;
+}
+
+static void ReleaseChunk(Chunk *chunk)
+{
+	if (--chunk->refs <= 0)
+		free(chunk);
+}
+
+static void EndWatcher(Worker *w, Watcher *wt)
+{
+	Watcher **p;
+
+	if (wt->dead)
+		return;
+	wt->dead = 1;
+	CancelTimer(&wt->drain);
+	if (wt->match) {
+		for (p = &wt->match->watchers; *p != wt; p = &(*p)->next)
+			;
+		*p = wt->next;
+	}
+	epoll_ctl(w->epfd, EPOLL_CTL_DEL, wt->fd, NULL);
+	close(wt->fd);
+	wt->next = w->deadWatchers;
+	w->deadWatchers = wt;
+}
+
+/* Finished with; freed once the current batch of events is done */
+static void EndMatch(Worker *w, Match *m, char *why)
+{
+	Watcher *wt, *next;
+	Match **p;
+	int i;
+
+	if (m->dead)
+		return;
+	m->dead = 1;
+	CancelTimer(&m->idle);
+	for (i = 0; i < 2; ++i) {
+		epoll_ctl(w->epfd, EPOLL_CTL_DEL, m->conn[i].fd, NULL);
+		close(m->conn[i].fd);
+	}
+	/* Spectators get what's on its way, then they're done too */
+	for (wt = m->watchers; wt; wt = next) {
+		next = wt->next;
+		wt->match = NULL;
+		if (!wt->count)
+			EndWatcher(w, wt);
+		else
+			ArmTimer(&w->timers, &wt->drain,
+				w->now + DRAIN_TIME * (int64_t)1000000000);
+	}
+	m->watchers = NULL;
+	Log("match %d: %s\n", m->id, why);
+	for (p = &w->live; *p != m; p = &(*p)->next)
+		;
+	*p = m->next;
+	m->next = w->dead;
+	w->dead = m;
+}
+
+static void FreeDead(Worker *w)
+{
+	Watcher *wt;
+	Match *m;
+	int i;
+
+	while ((m = w->dead)) {
+		w->dead = m->next;
+		for (i = 0; i < 2; ++i)
+			free(m->conn[i].out);
+		free(m);
+	}
+	while ((wt = w->deadWatchers)) {
+		w->deadWatchers = wt->next;
+		for (i = 0; i < wt->count; ++i)
+			ReleaseChunk(wt->queue[(wt->first + i) % MAX_CHUNKS]);
+		free(wt);
+	}
+}
+
+/* Write as much of c's queue as the socket will take */
+static int Flush(Worker *w, Conn *c)
+{
+	int result;
+
+	while (c->outSize > 0) {
+		result = write(c->fd, c->out, c->outSize);
+		if (result > 0) {
+			memmove(c->out, c->out + result, c->outSize - result);
+			c->outSize -= result;
+		}
+		else if (result < 0 && errno == EINTR)
+			continue;
+		else if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		else
+			return -1;
+	}
+	if (c->wantOut != (c->outSize > 0))
+		WatchConn(w, c, EPOLL_CTL_MOD);
+	return 0;
+}
+
+/* Write a spectator's chunks straight from where they're shared */
+static void FlushWatcher(Worker *w, Watcher *wt)
+{
+	struct iovec iov[MAX_IOV];
+	Chunk *chunk;
+	int n, result;
+
+	while (wt->count > 0) {
+		for (n = 0; n < wt->count && n < MAX_IOV; ++n) {
+			chunk = wt->queue[(wt->first + n) % MAX_CHUNKS];
+			iov[n].iov_base = chunk->data + (n ? 0 : wt->offset);
+			iov[n].iov_len = chunk->size - (n ? 0 : wt->offset);
+		}
+		result = writev(wt->fd, iov, n);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (result <= 0) {
+			EndWatcher(w, wt);
+			return;
+		}
+		wt->stalled = 0;
+		result += wt->offset;
+		while (wt->count > 0 &&
+				result >= (chunk = wt->queue[wt->first])->size) {
+			result -= chunk->size;
+			ReleaseChunk(chunk);
+			wt->first = (wt->first + 1) % MAX_CHUNKS;
+			--wt->count;
+		}
+		wt->offset = result;
+	}
+	if (!wt->count && !wt->match) {
+		EndWatcher(w, wt);
+		return;
+	}
+	if (wt->wantOut != (wt->count > 0)) {
+		wt->wantOut = wt->count > 0;
+		Watch(w, wt->fd, wt, EPOLL_CTL_MOD, wt->wantOut);
+	}
+}
+
+static Chunk *NewChunk(int size)
+{
+	Chunk *chunk;
+
+	if (!(chunk = malloc(sizeof(Chunk) + size)))
+		Fail("malloc");
+	chunk->refs = 1;			/* The caller's */
+	chunk->size = 0;
+	return chunk;
+}
+
+static void PutPacket(Chunk *chunk, NetPacketType type, int size, void *data)
+{
+	netint2 header[2];
+
+	header[0] = hton2(type);
+	header[1] = hton2(size + HEADER_SIZE);
+	memcpy(chunk->data + chunk->size, header, HEADER_SIZE);
+	memcpy(chunk->data + chunk->size + HEADER_SIZE, data, size);
+	chunk->size += HEADER_SIZE + size;
+}
+
+/* Says whose board the packets after it are about */
+static void PutPlayer(Chunk *chunk, int scr, int reset)
+{
+	netint2 data[2];
+
+	data[0] = hton2(scr);
+	data[1] = hton2(reset);
+	PutPacket(chunk, NP_player, sizeof(data), data);
+}
+
+/* Both boards as they are now, for a spectator starting afresh */
+static Chunk *Snapshot(Match *m)
+{
+	char line[sizeof(netint2) + MAX_BOARD_WIDTH];
+	netint2 data[4];
+	BlockType *row;
+	Mirror *mirror;
+	Board *b;
+	Chunk *chunk;
+	int scr, y, x, any;
+
+	chunk = NewChunk(2 * (3 * HEADER_SIZE + sizeof(netint2[6])
+		+ sizeof(m->name[0]) + MAX_BOARD_HEIGHT * (HEADER_SIZE + sizeof(line)))
+		+ HEADER_SIZE + sizeof(netint2[2]));
+	for (scr = 0; scr < 2; ++scr) {
+		mirror = &m->mirror[scr];
+		b = mirror->board;
+		PutPlayer(chunk, scr, 1);
+		if (m->name[scr][0])
+			PutPacket(chunk, NP_userName, strlen(m->name[scr]) + 1,
+				m->name[scr]);
+		for (y = 0; y < b->height; ++y) {
+			row = BoardLine(b, y);
+			for (x = any = 0; x < b->width; ++x)
+				if ((line[sizeof(netint2) + x] = row[x] > 0 ? row[x] : 0))
+					any = 1;
+			if (!any)
+				continue;
+			data[0] = hton2(y);
+			memcpy(line, data, sizeof(netint2));
+			PutPacket(chunk, NP_snapshot, sizeof(netint2) + b->width, line);
+		}
+		if (mirror->shape) {
+			data[0] = hton2(ShapeToNetNum(mirror->shape));
+			data[1] = hton2(mirror->y);
+			data[2] = hton2(mirror->x);
+			data[3] = hton2(mirror->ticks);	/* Already counted in y */
+			PutPacket(chunk, NP_place, sizeof(data), data);
+		}
+	}
+	PutPlayer(chunk, m->lastScr, 0);
+	return chunk;
+}
+
+/* Each queue holds a reference, as does whoever made the chunk */
+static void QueueChunk(Watcher *wt, Chunk *chunk)
+{
+	++chunk->refs;
+	wt->queue[(wt->first + wt->count++) % MAX_CHUNKS] = chunk;
+}
+
+/* Start over from a snapshot, dropping whatever's still to be sent */
+static void Resync(Worker *w, Watcher *wt)
+{
+	Chunk *chunk;
+
+	if (wt->stalled) {
+		Log("match %d: spectator dropped\n", wt->match->id);
+		EndWatcher(w, wt);
+		return;
+	}
+	while (wt->count > (wt->offset > 0)) {
+		--wt->count;
+		ReleaseChunk(wt->queue[(wt->first + wt->count) % MAX_CHUNKS]);
+	}
+	chunk = Snapshot(wt->match);
+	QueueChunk(wt, chunk);
+	ReleaseChunk(chunk);
+	wt->stalled = 1;
+}
+
+static void Broadcast(Worker *w, Match *m, Chunk *chunk)
+{
+	Watcher *wt, *next;
+
+	for (wt = m->watchers; wt; wt = next) {
+		next = wt->next;
+		if (wt->count == MAX_CHUNKS)
+			Resync(w, wt);
+		else
+			QueueChunk(wt, chunk);
+		if (!wt->dead)
+			FlushWatcher(w, wt);
+	}
+}
+
+static int Queue(Conn *c, void *data, int size)
+{
+	if (c->outSize + size > c->outAlloc) {
+		if (c->outSize + size > MAX_OUT_BUF)
+			return -1;
+		c->outAlloc = c->outAlloc ? c->outAlloc * 2 : 256;
+		if (c->outAlloc > MAX_OUT_BUF)
+			c->outAlloc = MAX_OUT_BUF;
+		if (!(c->out = realloc(c->out, c->outAlloc)))
+			return -1;
+	}
+	memcpy(c->out + c->outSize, data, size);
+	c->outSize += size;
+	return 0;
+}
+
+/* The few packets the relay has to change on their way through */
+static void Rewrite(Match *m, char *packet, int size)
+{
+	netint2 header[2];
+	netint4 data[2];
+
+	memcpy(header, packet, HEADER_SIZE);
+	switch (ntoh2(header[0])) {
+		case NP_version:
+			if (size < HEADER_SIZE + sizeof(data))
+				break;
+			memcpy(data, packet + HEADER_SIZE, sizeof(data));
+			if (ntoh4(data[1]) > RELAY_VERSION)
+				data[1] = hton4(RELAY_VERSION);
+			memcpy(packet + HEADER_SIZE, data, sizeof(data));
+			break;
+		case NP_startConn:
+			if (size < HEADER_SIZE + sizeof(data))
+				break;
+			memcpy(data, packet + HEADER_SIZE, sizeof(data));
+			if (!m->gotSeed) {
+				m->seed = data[1];
+				m->gotSeed = 1;
+			}
+			data[1] = m->seed;
+			data[0] = hton4(ntoh4(data[0]) & ~SCF_localGravity);
+			memcpy(packet + HEADER_SIZE, data, sizeof(data));
+			break;
+	}
+}
+
+/* Packets about the game, as opposed to setting it up */
+static int Watchable(int type)
+{
+	switch (type) {
+		case NP_newPiece: case NP_down: case NP_left: case NP_right:
+		case NP_rotate: case NP_drop: case NP_clear: case NP_insertJunk:
+		case NP_userName: case NP_pause: case NP_shift: case NP_tick:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/*
+ * Pass every whole packet c has sent on to its opponent, play it on the
+ * match's copy of c's board, and send it to the spectators.
+ */
+static int Relay(Worker *w, Match *m, Conn *c)
+{
+	netint2 header[2];
+	Chunk *chunk = NULL;
+	char *packet;
+	int pos = 0, size, type, len;
+
+	if (m->watchers)
+		chunk = NewChunk(c->inSize + HEADER_SIZE + sizeof(netint2[2]));
+	while (c->inSize - pos >= HEADER_SIZE) {
+		packet = c->in + pos;
+		memcpy(header, packet, HEADER_SIZE);
+		type = ntoh2(header[0]);
+		size = ntoh2(header[1]);
+		if (size < HEADER_SIZE || size >= MAX_PACKET_SIZE)
+			goto bad;
+		if (c->inSize - pos < size)
+			break;
+		Rewrite(m, packet, size);
+		if (Queue(c->peer, packet, size) < 0)
+			goto bad;
+		if (type == NP_userName) {
+			len = size - HEADER_SIZE;
+			if (len > sizeof(m->name[0]) - 1)
+				len = sizeof(m->name[0]) - 1;
+			memcpy(m->name[c->scr], packet + HEADER_SIZE, len);
+		}
+		MirrorPacket(&m->mirror[c->scr], type, size - HEADER_SIZE,
+			packet + HEADER_SIZE);
+		if (Watchable(type)) {
+			if (chunk) {
+				if (m->lastScr != c->scr)
+					PutPlayer(chunk, c->scr, 0);
+				memcpy(chunk->data + chunk->size, packet, size);
+				chunk->size += size;
+			}
+			m->lastScr = c->scr;
+		}
+		pos += size;
+	}
+	memmove(c->in, c->in + pos, c->inSize - pos);
+	c->inSize -= pos;
+	if (chunk) {
+		if (chunk->size > 0)
+			Broadcast(w, m, chunk);
+		ReleaseChunk(chunk);
+	}
+	return 0;
+
+bad:
+	free(chunk);
+	return -1;
+}
+
+static void HandleConn(Worker *w, Conn *c, unsigned int events)
+{
+	Match *m = c->match;
+	int result;
+
+	if (m->dead)
+		return;
+	if (events & EPOLLOUT) {
+		if (Flush(w, c) < 0) {
+			EndMatch(w, m, "write failed");
+			return;
+		}
+	}
+	if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		return;
+	do {
+		result = read(c->fd, c->in + c->inSize, sizeof(c->in) - c->inSize);
+	} while (result < 0 && errno == EINTR);
+	if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+	if (result <= 0) {
+		/* Let the other one have whatever was still on its way */
+		Flush(w, c->peer);
+		EndMatch(w, m, result < 0 ? "read failed" : "player left");
+		return;
+	}
+	c->inSize += result;
+	if (idleTime)
+		ArmTimer(&w->timers, &m->idle, w->now + idleTime);
+	if (Relay(w, m, c) < 0) {
+		EndMatch(w, m, "bad packet or player too slow");
+		return;
+	}
+	if (Flush(w, c->peer) < 0)
+		EndMatch(w, m, "write failed");
+}
+
+/* Spectators have nothing to say; we only listen for them leaving */
+static void HandleWatcher(Worker *w, Watcher *wt, unsigned int events)
+{
+	char buf[256];
+	int result;
+
+	if (wt->dead)
+		return;
+	if (events & EPOLLOUT)
+		FlushWatcher(w, wt);
+	if (wt->dead || !(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		return;
+	do {
+		result = read(wt->fd, buf, sizeof(buf));
+	} while (result < 0 && errno == EINTR);
+	if (result == 0 || (result < 0 && errno != EAGAIN
+			&& errno != EWOULDBLOCK))
+		EndWatcher(w, wt);
+}
+
+static void DrainExpired(Timer *t)
+{
+	Watcher *wt = t->data;
+
+	EndWatcher(wt->worker, wt);
+}
+
+static void IdleMatch(Timer *t)
+{
+	Match *m = t->data;
+
+	EndMatch(m->worker, m, "idle for too long");
+}
+
+static void AddMatch(Worker *w, Match *m)
+{
+	int i;
+
+	m->worker = w;
+	InitTimer(&m->idle, IdleMatch, m);
+	if (idleTime)
+		ArmTimer(&w->timers, &m->idle, w->now + idleTime);
+	for (i = 0; i < 2; ++i) {
+		InitBoard(&m->board[i], NULL, i);
+		InitMirror(&m->mirror[i], &m->board[i]);
+		WatchConn(w, &m->conn[i], EPOLL_CTL_ADD);
+	}
+	m->next = w->live;
+	w->live = m;
+	Log("match %d: started\n", m->id);
+}
+
+static void AddWatcher(Worker *w, int fd, int id)
+{
+	Watcher *wt;
+	Chunk *chunk;
+	Match *m;
+
+	for (m = w->live; m && m->id != id; m = m->next)
+		;
+	if (!m) {
+		close(fd);
+		return;
+	}
+	if (!(wt = calloc(1, sizeof(Watcher))))
+		Fail("calloc");
+	wt->kind = K_watcher;
+	wt->fd = fd;
+	wt->match = m;
+	wt->worker = w;
+	InitTimer(&wt->drain, DrainExpired, wt);
+	wt->next = m->watchers;
+	m->watchers = wt;
+	chunk = Snapshot(m);
+	QueueChunk(wt, chunk);
+	ReleaseChunk(chunk);
+	Watch(w, fd, wt, EPOLL_CTL_ADD, 0);
+	Log("match %d: spectator joined\n", m->id);
+	FlushWatcher(w, wt);
+}
+
+static void *WorkerLoop(void *arg)
+{
+	Worker *w = arg;
+	struct epoll_event events[MAX_EVENTS];
+	WakeMsg msg;
+	int n, i;
+
+	for (;;) {
+		n = epoll_wait(w->epfd, events, MAX_EVENTS,
+			NextTimeout(&w->timers, w->now));
+		w->now = MonoTime();
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			Fail("epoll_wait");
+		}
+		for (i = 0; i < n; ++i) {
+			if (!events[i].data.ptr) {
+				while (read(w->wake[0], &msg, sizeof(msg)) == sizeof(msg))
+					if (msg.match)
+						AddMatch(w, msg.match);
+					else
+						AddWatcher(w, msg.fd, msg.id);
+			}
+			else if (*(int *)events[i].data.ptr == K_watcher)
+				HandleWatcher(w, events[i].data.ptr, events[i].events);
+			else
+				HandleConn(w, events[i].data.ptr, events[i].events);
+		}
+		RunTimers(&w->timers, w->now);
+		FreeDead(w);
+	}
+	return NULL;
+}
+
+static void StartWorkers(void)
+{
+	struct epoll_event ev;
+	Worker *w;
+	int i;
+
+	if (!(workers = calloc(numWorkers, sizeof(Worker))))
+		Fail("calloc");
+	for (i = 0; i < numWorkers; ++i) {
+		w = &workers[i];
+		if ((w->epfd = epoll_create(MAX_EVENTS)) < 0)
+			Fail("epoll_create");
+		if (pipe(w->wake) < 0)
+			Fail("pipe");
+		SetNonBlocking(w->wake[0]);
+		InitTimerWheel(&w->timers);
+		w->now = MonoTime();
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wake[0], &ev) < 0)
+			Fail("epoll_ctl");
+		if (pthread_create(&w->thread, NULL, WorkerLoop, w))
+			Fail("pthread_create");
+	}
+}
+
+/* Everything about match number id goes to the same worker */
+static void Wake(int id, WakeMsg *msg)
+{
+	if (write(workers[(id - 1) % numWorkers].wake[1], msg, sizeof(*msg))
+			!= sizeof(*msg))
+		Fail("write");
+}
+
+/* Is a player who's been waiting for an opponent still there? */
+static int StillThere(int fd)
+{
+	char c;
+	int result;
+
+	result = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	return result > 0 || (result < 0 && (errno == EAGAIN
+			|| errno == EWOULDBLOCK || errno == EINTR));
+}
+
+static int lastId;
+
+static void NewMatch(int fd0, int fd1)
+{
+	WakeMsg msg;
+	Match *m;
+	int i;
+
+	if (!(m = calloc(1, sizeof(Match))))
+		Fail("calloc");
+	m->id = ++lastId;
+	for (i = 0; i < 2; ++i) {
+		m->conn[i].kind = K_player;
+		m->conn[i].match = m;
+		m->conn[i].peer = &m->conn[1 - i];
+		m->conn[i].fd = i ? fd1 : fd0;
+		m->conn[i].scr = i;
+	}
+	msg.match = m;
+	Wake(m->id, &msg);
+}
+
+/*
+ * Spectators who have yet to send all of their NP_watch.  The acceptor
+ * reads these itself, so they don't tie up a worker.
+ */
+typedef struct _Pending {
+	int fd, got;
+	char packet[HEADER_SIZE + sizeof(netint4)];
+} Pending;
+
+static Pending pending[MAX_PENDING];
+static int numPending;
+
+static void DropPending(int i)
+{
+	pending[i] = pending[--numPending];
+}
+
+static void ReadPending(int i)
+{
+	Pending *p = &pending[i];
+	netint2 header[2];
+	netint4 data[1];
+	WakeMsg msg;
+	int result, id;
+
+	result = read(p->fd, p->packet + p->got, sizeof(p->packet) - p->got);
+	if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK
+			|| errno == EINTR))
+		return;
+	if (result <= 0) {
+		close(p->fd);
+		DropPending(i);
+		return;
+	}
+	if ((p->got += result) < sizeof(p->packet))
+		return;
+	memcpy(header, p->packet, HEADER_SIZE);
+	memcpy(data, p->packet + HEADER_SIZE, sizeof(data));
+	id = ntoh4(data[0]) ? ntoh4(data[0]) : lastId;
+	if (ntoh2(header[0]) != NP_watch || ntoh2(header[1]) != sizeof(p->packet)
+			|| id < 1 || id > lastId)
+		close(p->fd);
+	else {
+		msg.match = NULL;
+		msg.fd = p->fd;
+		msg.id = id;
+		Wake(id, &msg);
+	}
+	DropPending(i);
+}
+
+static int Listen(short port)
+{
+	struct sockaddr_in addr;
+	int fd, val;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		Fail("socket");
+	val = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void *)&val, sizeof(val));
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		Fail("bind");
+	if (listen(fd, SOMAXCONN) < 0)
+		Fail("listen");
+	SetNonBlocking(fd);
+	return fd;
+}
+
+static int Accept(int sockListen)
+{
+	int fd, val;
+
+	if ((fd = accept(sockListen, NULL, NULL)) < 0) {
+		if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK
+				|| errno == ECONNABORTED || errno == EMFILE
+				|| errno == ENFILE)
+			return -1;
+		Fail("accept");
+	}
+	SetNonBlocking(fd);
+	val = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void *)&val, sizeof(val));
+	return fd;
+}
+
+static void DaemonUsage(void)
+{
+	fprintf(stderr,
+	  "Usage: netrisd [-v] [-p port] [-w port] [-t threads] [-i sec]\n"
+	  "  -p <port>\tPort to listen on for players (%d)\n"
+	  "  -w <port>\tPort to listen on for spectators (%d), or 0\n"
+	  "  -t <threads>\tNumber of worker threads (one per CPU)\n"
+	  "  -i <sec>\tEnd matches where nobody has sent anything for\n"
+	  "\t\tthis long (%d), or 0 for never\n"
+	  "  -v\t\tLog matches starting and ending\n",
+	  DEFAULT_PORT, DEFAULT_WATCH_PORT, DEFAULT_IDLE);
+}
+
+ExtFunc int main(int argc, char **argv)
+{
+	struct pollfd fds[2 + MAX_PENDING];
+	int sockListen, watchListen = -1, fd, waiting = -1, ch, i;
+	short port = DEFAULT_PORT, watchPort = DEFAULT_WATCH_PORT;
+
+	numWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((ch = getopt(argc, argv, "p:w:t:i:vh")) != -1)
+		switch (ch) {
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'w':
+				watchPort = atoi(optarg);
+				break;
+			case 't':
+				numWorkers = atoi(optarg);
+				break;
+			case 'i':
+				idleTime = atoi(optarg) * (int64_t)1000000000;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			case 'h':
+				DaemonUsage();
+				exit(0);
+			default:
+				DaemonUsage();
+				exit(1);
+		}
+	if (numWorkers < 1)
+		numWorkers = 1;
+	signal(SIGPIPE, SIG_IGN);
+	InitShapes();
+
+	sockListen = Listen(port);
+	if (watchPort)
+		watchListen = Listen(watchPort);
+	StartWorkers();
+	Log("netrisd: listening on port %d with %d worker%s\n", port,
+		numWorkers, numWorkers == 1 ? "" : "s");
+
+	for (;;) {
+		fds[0].fd = sockListen;
+		fds[1].fd = watchListen;
+		for (i = 0; i < numPending; ++i)
+			fds[2 + i].fd = pending[i].fd;
+		for (i = 0; i < 2 + numPending; ++i)
+			fds[i].events = POLLIN;
+		if (poll(fds, 2 + numPending, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			Fail("poll");
+		}
+		for (i = numPending - 1; i >= 0; --i)
+			if (fds[2 + i].revents)
+				ReadPending(i);
+		if ((fds[1].revents & POLLIN) && (fd = Accept(watchListen)) >= 0) {
+			if (numPending == MAX_PENDING) {
+				close(pending[0].fd);
+				DropPending(0);
+			}
+			pending[numPending].fd = fd;
+			pending[numPending++].got = 0;
+		}
+		if (!(fds[0].revents & POLLIN) || (fd = Accept(sockListen)) < 0)
+			continue;
+		if (waiting >= 0 && !StillThere(waiting)) {
+			close(waiting);
+			waiting = -1;
+		}
+		if (waiting < 0)
+			waiting = fd;
+		else {
+			NewMatch(waiting, fd);
+			waiting = -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * vi: ts=4 ai
+ * vim: noai si
+ */
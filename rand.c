@@ -0,0 +1,113 @@
+/*
+ * Netris -- A free networked version of T*tris
+ * Copyright (C) 1994-2016  Mark H. Weaver et al
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include "netris.h"
+
+/*
+ * Random numbers come in streams, so that each game (or each player in
+ * netris-sim) can have its own.  A stream is xoshiro256**, seeded by
+ * running the seed through splitmix64.  Peers older than protocol 6
+ * pick their pieces with the old 15-bit generator, which a stream can
+ * still be asked to be; a match with one of them must use it too, or
+ * "-s" wouldn't give both players the same pieces.
+ */
+
+static RandStream gameStream;	/* For Random() and the local game */
+static int legacyRandom;
+
+static uint64_t SplitMix(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static uint64_t Rotl(uint64_t x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+ExtFunc void SeedStream(RandStream *r, int seed, int legacy)
+{
+	uint64_t x = (uint32_t)seed;
+	int i;
+
+	for (i = 0; i < 4; ++i)
+		r->s[i] = SplitMix(&x);
+	r->legacy = legacy;
+	r->lcg = seed % 31751 + 1;
+}
+
+/* 64 random bits; not for legacy streams */
+ExtFunc uint64_t NextRandom(RandStream *r)
+{
+	uint64_t *s = r->s;
+	uint64_t result = Rotl(s[1] * 5, 7) * 9, t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = Rotl(s[3], 45);
+	return result;
+}
+
+/*
+ * min <= result < max1.  My really crappy random number generator is
+ * kept for the legacy streams.
+ */
+ExtFunc int StreamRandom(RandStream *r, int min, int max1)
+{
+	if (r->legacy) {
+		r->lcg = (r->lcg * 31751 + 15437) % 32767;
+		return r->lcg % (max1 - min) + min;
+	}
+	return (int)(((NextRandom(r) >> 32) * (uint32_t)(max1 - min)) >> 32)
+		+ min;
+}
+
+/* Whether SeedRandom() makes the game's stream a legacy one */
+ExtFunc void UseLegacyRandom(int legacy)
+{
+	legacyRandom = legacy;
+}
+
+ExtFunc void SeedRandom(int seed)
+{
+	SeedStream(&gameStream, seed, legacyRandom);
+}
+
+ExtFunc int Random(int min, int max1)
+{
+	return StreamRandom(&gameStream, min, max1);
+}
+
+ExtFunc RandStream *GameStream(void)
+{
+	return &gameStream;
+}
+
+/*
+ * vi: ts=4 ai
+ * vim: noai si
+ */
@@ -0,0 +1,634 @@
+/*
+ * Netris -- A free networked version of T*tris
+ * Copyright (C) 1994-2016  Mark H. Weaver et al
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include "netris.h"
+#include <time.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#ifdef HAS_PTHREAD
+#include <pthread.h>
+#endif
+
+/*
+ * The screen, as the game sees it.  The layout, the formatting and the
+ * keyboard are done here, on the game's thread, but the drawing is
+ * done by a backend (curses.c or ansi.c) on a render thread of its
+ * own.  The two talk through a queue of commands, so a slow terminal
+ * holds up the screen and nothing else.
+ *
+ * The queue is a ring with one producer and one consumer, so it needs
+ * no lock: each side writes only its own index.  The render thread
+ * sleeps on a condition variable when the ring is empty, and is only
+ * woken for a command that shows something: the game can queue any
+ * number of changes before it asks for a frame.  When the ring is
+ * nearly full, PlotBlock and PlotUnderline refuse, and the board keeps
+ * the change for its next RefreshBoard; other commands wait for room.
+ *
+ * Without pthreads the commands are carried out as they're queued.
+ */
+
+#define QUEUE_SIZE		2048	/* Commands; a power of two */
+#define TEXT_RESERVE	64		/* Room blocks leave for the rest */
+#define RENDER_TEXT		80
+#define MAX_FIELDS		24		/* Status fields; see Field() */
+
+typedef enum _RenderCmdType {
+	RC_init, RC_cleanup, RC_text, RC_block, RC_invert, RC_present,
+	RC_redraw
+} RenderCmdType;
+
+typedef struct _RenderCmd {
+	short type, y, x;
+	short arg;					/* Block type, width, or eol */
+	char text[RENDER_TEXT];
+} RenderCmd;
+
+static MyEventType KeyGenFunc(EventGenRec *gen, MyEvent *event);
+static MyEventType FrameGenFunc(EventGenRec *gen, MyEvent *event);
+
+static EventGenRec keyGen =
+		{ NULL, 0, FT_read, STDIN_FILENO, KeyGenFunc, EM_key };
+static EventGenRec frameGen =
+		{ NULL, 0, FT_read, -1, FrameGenFunc, EM_frame };
+static Timer frameTimer;
+static int64_t lastFrame;		/* When the last frame was presented */
+
+static RenderBackend *backend;
+static RenderCmd queue[QUEUE_SIZE];
+static int lastType = -1;		/* Of the last command queued */
+static int behind;				/* Blocks were refused for want of room */
+
+static int boardYPos[MAX_SCREENS], boardXPos[MAX_SCREENS];
+static int boardVisible[MAX_SCREENS], boardWidth[MAX_SCREENS];
+static int statusYPos, statusXPos;
+static int screens_dirty = 0;
+
+/* What's on the screen in each status field, by position */
+static struct { short y, x; char text[RENDER_TEXT]; } fields[MAX_FIELDS];
+static int numFields;
+
+static Timer clockTimer;
+static char clockText[32];		/* Formatted once a minute */
+
+static void RunCmd(RenderCmd *cmd)
+{
+	switch (cmd->type) {
+		case RC_init:
+			backend->init();
+			break;
+		case RC_cleanup:
+			backend->cleanup();
+			break;
+		case RC_text:
+			backend->text(cmd->y, cmd->x, cmd->text, cmd->arg);
+			break;
+		case RC_block:
+			backend->block(cmd->y, cmd->x, cmd->arg);
+			break;
+		case RC_invert:
+			backend->invert(cmd->y, cmd->x, cmd->arg);
+			break;
+		case RC_present:
+			backend->present(cmd->y, cmd->x);
+			break;
+		case RC_redraw:
+			backend->redraw();
+			break;
+	}
+}
+
+#ifdef HAS_PTHREAD
+
+/* On lines of their own, so the two threads don't fight over them */
+static struct { volatile unsigned int index; char pad[60]; } head, tail;
+static pthread_t renderThread;
+static pthread_mutex_t wakeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeCond = PTHREAD_COND_INITIALIZER;
+static int sleeping;
+static unsigned int redrawAt = -1;		/* Where the last redraw was queued */
+
+static unsigned int QueueUsed(void)
+{
+	return __atomic_load_n(&head.index, __ATOMIC_SEQ_CST)
+		- __atomic_load_n(&tail.index, __ATOMIC_SEQ_CST);
+}
+
+static void WakeRenderer(void)
+{
+	if (__atomic_load_n(&sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&wakeLock);
+		pthread_cond_signal(&wakeCond);
+		pthread_mutex_unlock(&wakeLock);
+	}
+}
+
+/*
+ * Run commands until told to stop.  A present waits until the ring is
+ * empty, so frames the terminal is too slow for run together.
+ */
+static void *RenderLoop(void *arg)
+{
+	RenderCmd *cmd, present;
+	unsigned int t = tail.index;
+	int presentDue = 0;
+
+	for (;;) {
+		if (t == __atomic_load_n(&head.index, __ATOMIC_ACQUIRE)) {
+			if (presentDue) {
+				RunCmd(&present);
+				presentDue = 0;
+				continue;
+			}
+			pthread_mutex_lock(&wakeLock);
+			__atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+			while (t == __atomic_load_n(&head.index, __ATOMIC_SEQ_CST))
+				pthread_cond_wait(&wakeCond, &wakeLock);
+			__atomic_store_n(&sleeping, 0, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&wakeLock);
+			continue;
+		}
+		cmd = &queue[t % QUEUE_SIZE];
+		if (cmd->type == RC_present) {
+			present = *cmd;
+			presentDue = 1;
+		}
+		else
+			RunCmd(cmd);
+		if (cmd->type == RC_cleanup)
+			return NULL;
+		__atomic_store_n(&tail.index, ++t, __ATOMIC_RELEASE);
+	}
+}
+
+/* Signals are the game thread's business */
+static void StartRenderer(void)
+{
+	sigset_t all, saved;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &saved);
+	if (pthread_create(&renderThread, NULL, RenderLoop, NULL))
+		die("pthread_create");
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+
+static void StopRenderer(void)
+{
+	pthread_join(renderThread, NULL);
+}
+
+/* Until the render thread has done everything and gone to sleep */
+static void WaitRenderer(void)
+{
+	struct timespec pause = { 0, 1000000 };
+
+	while (QueueUsed() || !__atomic_load_n(&sleeping, __ATOMIC_SEQ_CST))
+		nanosleep(&pause, NULL);
+}
+
+/* A redraw that's still queued will do for another */
+static int RedrawQueued(void)
+{
+	return redrawAt - __atomic_load_n(&tail.index, __ATOMIC_SEQ_CST)
+		< QUEUE_SIZE;
+}
+
+/* A command to fill in, or NULL if that would leave less than reserve */
+static RenderCmd *NewCmd(int type, int reserve)
+{
+	struct timespec pause = { 0, 1000000 };
+
+	while (QUEUE_SIZE - QueueUsed() <= reserve) {
+		if (reserve)
+			return NULL;
+		WakeRenderer();
+		nanosleep(&pause, NULL);
+	}
+	queue[head.index % QUEUE_SIZE].type = type;
+	return &queue[head.index % QUEUE_SIZE];
+}
+
+static void QueueCmd(RenderCmd *cmd)
+{
+	lastType = cmd->type;
+	if (cmd->type == RC_redraw)
+		redrawAt = head.index;
+	__atomic_store_n(&head.index, head.index + 1, __ATOMIC_SEQ_CST);
+	if (cmd->type == RC_present || cmd->type == RC_cleanup)
+		WakeRenderer();
+}
+
+#else /* HAS_PTHREAD */
+
+static void StartRenderer(void)
+{
+}
+
+static void StopRenderer(void)
+{
+}
+
+static void WaitRenderer(void)
+{
+}
+
+static int RedrawQueued(void)
+{
+	return 0;
+}
+
+static RenderCmd *NewCmd(int type, int reserve)
+{
+	queue[0].type = type;
+	return &queue[0];
+}
+
+static void QueueCmd(RenderCmd *cmd)
+{
+	lastType = cmd->type;
+	RunCmd(cmd);
+}
+
+#endif /* HAS_PTHREAD */
+
+static void Command(int type, int y, int x, int arg)
+{
+	RenderCmd *cmd = NewCmd(type, 0);
+
+	cmd->y = y;
+	cmd->x = x;
+	cmd->arg = arg;
+	QueueCmd(cmd);
+}
+
+/* Put s at y, x; with eol, clear the rest of the line too */
+static void Text(int y, int x, int eol, const char *fmt, ...)
+{
+	RenderCmd *cmd = NewCmd(RC_text, 0);
+	va_list args;
+
+	cmd->y = y;
+	cmd->x = x;
+	cmd->arg = eol;
+	va_start(args, fmt);
+	vsnprintf(cmd->text, sizeof(cmd->text), fmt, args);
+	va_end(args);
+	QueueCmd(cmd);
+}
+
+/* Like Text(), but only if what's at y, x isn't that already */
+static void Field(int y, int x, int eol, const char *fmt, ...)
+{
+	char text[RENDER_TEXT];
+	va_list args;
+	int i;
+
+	va_start(args, fmt);
+	vsnprintf(text, sizeof(text), fmt, args);
+	va_end(args);
+	for (i = 0; i < numFields; ++i)
+		if (fields[i].y == y && fields[i].x == x)
+			break;
+	if (i < numFields && !strcmp(fields[i].text, text))
+		return;
+	if (i == numFields && numFields < MAX_FIELDS) {
+		fields[i].y = y;
+		fields[i].x = x;
+		++numFields;
+	}
+	if (i < numFields)
+		strcpy(fields[i].text, text);
+	Text(y, x, eol, "%s", text);
+}
+
+/* Show what's been queued, with the cursor out of the way */
+static void Present(void)
+{
+	lastFrame = GameClock();
+	if (lastType != RC_present)
+		Command(RC_present, boardYPos[0] + 1,
+			boardXPos[0] + 2 * boardWidth[0] + 1, 0);
+}
+
+static void FrameDue(Timer *t)
+{
+	frameGen.ready = 1;
+}
+
+static MyEventType FrameGenFunc(EventGenRec *gen, MyEvent *event)
+{
+	return E_frame;
+}
+
+/*
+ * Whether the boards should be refreshed and a frame presented now.
+ * Frames come no more than frameRate a second, unless they're urgent;
+ * when it's too soon, what's changed waits, and E_frame comes when it
+ * isn't.  Until then, changes to the boards pile up into one frame.
+ * With nothing dirty there's no frame to wait for.
+ */
+ExtFunc int FrameReady(int urgent, int dirty)
+{
+	int64_t now = GameClock(), next;
+
+	if (!dirty) {
+		CancelTimer(&frameTimer);
+		frameGen.ready = 0;
+		return 0;
+	}
+	if (!urgent && frameRate > 0) {
+		next = lastFrame + 1000000000 / frameRate;
+		if (now < next) {
+			StartTimer(&frameTimer, (next - now + 999) / 1000);
+			return 0;
+		}
+	}
+	CancelTimer(&frameTimer);
+	frameGen.ready = 0;
+	return 1;
+}
+
+/*
+ * Wait for the screen to show everything queued.  Returns whether any
+ * blocks were refused since last time, in which case the boards should
+ * be refreshed, and the screen synced again.
+ */
+ExtFunc int SyncScreen(void)
+{
+	int was = behind;
+
+	Present();
+	WaitRenderer();
+	behind = 0;
+	return was;
+}
+
+static void ShowClock(void)
+{
+	if (clockText[0])
+		Field(statusYPos, statusXPos, 0, "%s", clockText);
+}
+
+/*
+ * The clock only changes on the minute, so that's the only time it's
+ * formatted; localtime() may go and look at the time zone files.
+ * InitScreens() calls this with no timer, before there's anywhere to
+ * show it.
+ */
+static void ClockTick(Timer *t)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	strftime(clockText, sizeof(clockText), "%I:%M %p",
+		localtime(&tv.tv_sec));
+	StartTimer(&clockTimer,
+		(60 - tv.tv_sec % 60) * 1000000L - tv.tv_usec);
+	if (t) {
+		ShowClock();
+		Present();
+	}
+}
+
+ExtFunc void InitScreens(void)
+{
+	backend = ansiEnable ? AnsiBackend() : CursesBackend();
+	StartRenderer();
+	Command(RC_init, 0, 0, 0);
+	AtExit(CleanupScreens);
+	screens_dirty = 1;
+	AddEventGen(&keyGen);
+	AddEventGen(&frameGen);
+	InitTimer(&frameTimer, FrameDue, NULL);
+	InitTimer(&clockTimer, ClockTick, NULL);
+	ClockTick(NULL);
+	numFields = 0;
+
+	Text(0, 0, 0, "Netris %s (C) 1994-2016  Mark H. Weaver et al",
+		version_string);
+	Text(0, 55, 0, "\"netris -h\" for more info");
+
+	statusYPos = 22;
+	statusXPos = 0;
+}
+
+ExtFunc void CleanupScreens(void)
+{
+	if (screens_dirty) {
+		RemoveEventGen(&keyGen);
+		RemoveEventGen(&frameGen);
+		CancelTimer(&frameTimer);
+		CancelTimer(&clockTimer);
+		Command(RC_cleanup, 0, 0, 0);
+		StopRenderer();
+		screens_dirty = 0;
+	}
+}
+
+ExtFunc void InitScreen(int scr, int visible, int width)
+{
+	char line[2 * MAX_BOARD_WIDTH + 3];
+	int y;
+
+	boardVisible[scr] = visible;
+	boardWidth[scr] = width;
+
+	if (scr == 0)
+		boardXPos[scr] = 1;
+	else
+		boardXPos[scr] = boardXPos[scr - 1] +
+					2 * boardWidth[scr - 1] + 3;
+	boardYPos[scr] = 22;
+	if (statusXPos < boardXPos[scr] + 2 * boardWidth[scr] + 3)
+		statusXPos = boardXPos[scr] + 2 * boardWidth[scr] + 3;
+	memset(line, ' ', 2 * width + 2);
+	line[0] = line[2 * width + 1] = '|';
+	line[2 * width + 2] = 0;
+	for (y = boardVisible[scr] - 1; y >= 0; --y)
+		Text(boardYPos[scr] - y, boardXPos[scr] - 1, 0, "%s", line);
+	memset(line, '-', 2 * width + 2);
+	line[0] = line[2 * width + 1] = '+';
+	for (y = boardVisible[scr]; y >= -1; y -= boardVisible[scr] + 1)
+		Text(boardYPos[scr] - y, boardXPos[scr] - 1, 0, "%s", line);
+	ShowClock();
+}
+
+ExtFunc void InvertScreen(int scr)
+{
+	int y;
+
+	if (scr == 0)
+		boardXPos[scr] = 1;
+	else
+		boardXPos[scr] = boardXPos[scr - 1] +
+					2 * boardWidth[scr - 1] + 3;
+
+	for (y = 0; y < boardVisible[scr]; y++)
+		Command(RC_invert, 3 + y, boardXPos[scr], 2 * boardWidth[scr]);
+}
+
+ExtFunc void CleanupScreen(int scr)
+{
+}
+
+/* Returns 0 if there's no room for it yet; try again later */
+ExtFunc int PlotBlock(int scr, int y, int x, BlockType type)
+{
+	RenderCmd *cmd;
+
+	if (y < 0 || y >= boardVisible[scr] || x < 0 || x >= boardWidth[scr])
+		return 1;
+	if (!(cmd = NewCmd(RC_block, TEXT_RESERVE)))
+		return !(behind = 1);
+	cmd->y = boardYPos[scr] - y;
+	cmd->x = boardXPos[scr] + 2 * x;
+	cmd->arg = type;
+	QueueCmd(cmd);
+	return 1;
+}
+
+/* Likewise */
+ExtFunc int PlotUnderline(int scr, int x, int flag)
+{
+	RenderCmd *cmd;
+
+	if (!(cmd = NewCmd(RC_text, TEXT_RESERVE)))
+		return !(behind = 1);
+	cmd->y = boardYPos[scr] + 1;
+	cmd->x = boardXPos[scr] + 2 * x;
+	cmd->arg = 0;
+	strcpy(cmd->text, flag ? "==" : "--");
+	QueueCmd(cmd);
+	return 1;
+}
+
+ExtFunc void ClearStatus(void)
+{
+	Text(statusYPos - 1, statusXPos, 1, "");
+	Present();
+}
+
+ExtFunc void PrintStatus(const char *fmt, ...)
+{
+	char status[RENDER_TEXT];
+	va_list args;
+
+	va_start(args, fmt);
+	vsnprintf(status, sizeof(status), fmt, args);
+	va_end(args);
+	Text(statusYPos - 1, statusXPos, 1, "%s", status);
+	Present();
+}
+
+ExtFunc void ShowDisplayInfo(void)
+{
+	char lag[RENDER_TEXT] = "";
+
+	Field(statusYPos - 9, statusXPos, 1, "Seed:  %d", initSeed);
+	if (lateness.ticks) {
+		/* How far behind gravity ran last game: average/worst */
+		sprintf(lag, "  lag %.1f/%.1fms", lateness.total / 1e6 /
+			lateness.ticks, lateness.worst / 1e6);
+		if (lateness.missed)
+			sprintf(lag + strlen(lag), " %ld missed", lateness.missed);
+	}
+	Field(statusYPos - 8, statusXPos, 1, "Speed: %dms%s", speed / 1000, lag);
+
+	if(gameType == GT_onePlayer) {
+		Field(statusYPos - 5, statusXPos, 0, "Games lost       %3d", lost);
+		Field(statusYPos - 4, statusXPos, 0, "Rows (this game) %3d",
+			myLinesCleared);
+		Field(statusYPos - 3, statusXPos, 0, "Rows (all games) %3d",
+			myTotalLinesCleared);
+	} else {
+		Field(statusYPos - 7, statusXPos + 15, 0, "%s",
+			robotEnable ? "Robot" : "  You");
+		Field(statusYPos - 7, statusXPos + 24, 1, "%s%s",
+			(opponentFlags & SCF_usingRobot) ? "   Robot" : "Opponent",
+			(opponentFlags & SCF_usingRobot)
+				&& (opponentFlags & SCF_fairRobot) ? "(fair)" : "");
+
+		Field(statusYPos - 6, statusXPos, 0, "Games won        %3d", won);
+		Field(statusYPos - 5, statusXPos, 0, "Rows (this game) %3d",
+			myLinesCleared);
+		Field(statusYPos - 4, statusXPos, 0, "Rows (all games) %3d",
+			myTotalLinesCleared);
+
+		Field(statusYPos - 6, statusXPos + 22, 0, "%3d", lost);
+		Field(statusYPos - 5, statusXPos + 22, 0, "%3d",
+			opponentLinesCleared);
+		Field(statusYPos - 4, statusXPos + 22, 0, "%3d",
+			opponentTotalLinesCleared);
+	}
+}
+
+ExtFunc void UpdateOpponentDisplay(void)
+{
+	Text(1, 0, 1, "Playing %s@%s", opponentName, opponentHost);
+}
+
+ExtFunc void ShowWatching(char *name0, char *name1)
+{
+	Text(1, 0, 1, "Watching %s vs %s", name0, name1);
+}
+
+ExtFunc void ShowPause(int pausedByMe, int pausedByThem)
+{
+	Text(statusYPos - 2, statusXPos, 1, "%s",
+		pausedByMe && pausedByThem ? "Paused by you & opponent" :
+		pausedByMe ? "Paused by you" :
+		pausedByThem ? "Paused by opponent" : "");
+}
+
+ExtFunc void Message(char *s)
+{
+	static int line = 0;
+
+	Text(statusYPos - 20 + line, statusXPos, 1, "%s", s);
+	line = (line + 1) % 10;
+	Text(statusYPos - 20 + line, statusXPos, 1, "");
+}
+
+/* The clock keeps itself up to date; see ClockTick() */
+ExtFunc void RefreshScreen(void)
+{
+	Present();
+}
+
+ExtFunc void ScheduleFullRedraw(void)
+{
+	if (!RedrawQueued())
+		Command(RC_redraw, 0, 0, 0);
+}
+
+static MyEventType KeyGenFunc(EventGenRec *gen, MyEvent *event)
+{
+	if (MyRead(gen->fd, &event->u.key, 1))
+		return E_key;
+	else
+		return E_none;
+}
+
+/*
+ * vi: ts=4 ai
+ * vim: noai si
+ */
@@ -28,6 +28,8 @@
 #include <fcntl.h>
 #include <errno.h>
 
+#define ROBOT_START_TIME	15000000	/* To answer Version, in microseconds */
+
 static MyEventType RobotGenFunc(EventGenRec *gen, MyEvent *event);
 
 static EventGenRec robotGen =
@@ -42,6 +44,14 @@ static int robotBufSize, robotBufMsg;
 
 static int gotSigPipe;
 
+static Timer startTimer;
+static int robotLate;
+
+static void RobotLate(Timer *t)
+{
+	robotGen.ready = robotLate = 1;
+}
+
 ExtFunc void InitRobot(char *robotProg)
 {
 	int to[2], from[2];
@@ -78,8 +88,11 @@ ExtFunc void InitRobot(char *robotProg)
 		die("fcntl/F_SETFL");
 	AddEventGen(&robotGen);
 	RobotCmd(1, "Version %d\n", ROBOT_VERSION);
+	InitTimer(&startTimer, RobotLate, NULL);
+	StartTimer(&startTimer, ROBOT_START_TIME);
 	if (WaitMyEvent(&event, EM_robot) != E_robot)
 		fatal("Robot didn't start successfully");
+	CancelTimer(&startTimer);
 	if (1 > sscanf(event.u.robot.data, "Version %d", &robotVersion)
 			|| robotVersion < 1)
 		fatal("Invalid Version line from robot");
@@ -131,6 +144,10 @@ static MyEventType RobotGenFunc(EventGenRec *gen, MyEvent *event)
 		robotGen.ready = more;
 		return E_lostRobot;
 	}
+	if (robotLate) {
+		robotLate = 0;
+		return E_lostRobot;
+	}
 	if (robotBufMsg > 0) {
 		/*
 		 *	Grrrrrr!  SunOS 4.1 doesn't have memmove (or atexit)
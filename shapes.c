@@ -76,6 +76,8 @@ ShapeOption stdOptions[] = {
 	{1, &shape_s1_horiz},
 	{0, NULL}};
 
+ShapeTable stdTable;
+
 Shape *netMapping[] = {
 	&shape_long_horiz,
 	&shape_long_vert,
@@ -115,18 +117,16 @@ ExtFunc Dir RotateDir(Dir dir, int delta)
 	return 3 & (dir + delta);
 }
 
-ExtFunc int ShapeIterate(Shape *s, int scr, int y, int x, int falling,
-ExtFunc				ShapeDrawFunc func, void *data)
+static void CompileShape(Shape *s)
 {
-	int i, mirror, result;
+	int i, n, mirror, y, x;
 	Dir dir;
-	BlockType type;
 
-	y += s->initY;
-	x += s->initX;
+	y = s->initY;
+	x = s->initX;
 	dir = s->initDir;
-	type = falling ? -s->type : s->type;
 	mirror = s->mirrored ? -1 : 1;
+	n = 0;
 	for (i = 0; s->cmds[i] != C_end; ++i)
 		switch (s->cmds[i]) {
 			case C_forw:
@@ -142,23 +142,125 @@ ExtFunc				ShapeDrawFunc func, void *data)
 				dir = RotateDir(dir, -mirror);
 				break;
 			case C_plot:
-				if ((result = func(scr, y, x, type, data)))
-					return result;
+				assert(n < MAX_SHAPE_CELLS);
+				s->cellY[n] = y;
+				s->cellX[n] = x;
+				++n;
 				break;
 			default:
 				assert(0);
 		}
+	s->numCells = n;
+	s->minY = s->minX = s->maxX = 0;
+	for (i = 0; i < n; ++i) {
+		if (i == 0 || s->minY > s->cellY[i])
+			s->minY = s->cellY[i];
+		if (i == 0 || s->minX > s->cellX[i])
+			s->minX = s->cellX[i];
+		if (i == 0 || s->maxX < s->cellX[i])
+			s->maxX = s->cellX[i];
+	}
+	s->height = 0;
+	for (i = 0; i < MAX_SHAPE_CELLS; ++i) {
+		s->rowMask[i] = 0;
+		s->colBottom[i] = MAX_BOARD_HEIGHT;
+	}
+	for (i = 0; i < n; ++i) {
+		y = s->cellY[i] - s->minY;
+		x = s->cellX[i] - s->minX;
+		s->rowMask[y] |= (BoardRow)1 << x;
+		if (s->height < y + 1)
+			s->height = y + 1;
+		if (s->colBottom[x] > s->cellY[i])
+			s->colBottom[x] = s->cellY[i];
+	}
+}
+
+ExtFunc void InitShapes(void)
+{
+	int num;
+
+	for (num = 0; netMapping[num]; ++num)
+		CompileShape(netMapping[num]);
+	BuildShapeTable(&stdTable, stdOptions);
+}
+
+/*
+ * Calls func for each block of the shape.  The hot paths in board.c use
+ * the compiled tables directly, this is for everybody else.
+ */
+ExtFunc int ShapeIterate(Shape *s, Board *b, int y, int x, int falling,
+ExtFunc				ShapeDrawFunc func, void *data)
+{
+	int i, result;
+	BlockType type;
+
+	assert(s->numCells > 0);
+	type = falling ? -s->type : s->type;
+	for (i = 0; i < s->numCells; ++i)
+		if ((result = func(b, y + s->cellY[i], x + s->cellX[i],
+						type, data)))
+			return result;
 	return 0;
 }
 
-ExtFunc Shape *ChooseOption(ShapeOption *options)
+/*
+ * Walker's alias method: each of the count columns holds its own option
+ * with odds keep, and one other (its alias) the rest of the time.  The
+ * columns are filled by pairing an option with less than the average
+ * weight with one with more, which gives up the difference.
+ */
+ExtFunc void BuildShapeTable(ShapeTable *t, ShapeOption *options)
+{
+	double total = 0, p[MAX_SHAPE_OPTIONS];
+	int small[MAX_SHAPE_OPTIONS], large[MAX_SHAPE_OPTIONS];
+	int numSmall = 0, numLarge = 0, i, s, l;
+
+	for (i = 0; options[i].shape; ++i)
+		total += options[i].weight;
+	assert(i > 0 && i <= MAX_SHAPE_OPTIONS && total > 0);
+	t->options = options;
+	t->count = i;
+	for (i = 0; i < t->count; ++i) {
+		p[i] = options[i].weight * t->count / total;
+		if (p[i] < 1)
+			small[numSmall++] = i;
+		else
+			large[numLarge++] = i;
+	}
+	while (numSmall && numLarge) {
+		s = small[--numSmall];
+		l = large[--numLarge];
+		t->keep[s] = p[s] * 4294967296.0;
+		t->alias[s] = l;
+		p[l] -= 1 - p[s];
+		if (p[l] < 1)
+			small[numSmall++] = l;
+		else
+			large[numLarge++] = l;
+	}
+	/* Whatever's left is 1, give or take rounding */
+	while (numLarge) {
+		l = large[--numLarge];
+		t->keep[l] = (uint64_t)1 << 32;
+		t->alias[l] = l;
+	}
+	while (numSmall) {
+		s = small[--numSmall];
+		t->keep[s] = (uint64_t)1 << 32;
+		t->alias[s] = s;
+	}
+}
+
+/* The old way, a scan of the weights, for legacy streams */
+static Shape *LegacyChoose(ShapeOption *options, RandStream *r)
 {
 	int i;
 	float total = 0, val;
 
 	for (i = 0; options[i].shape; ++i)
 		total += options[i].weight;
-	val = Random(0, 32767) / 32768.0 * total;
+	val = StreamRandom(r, 0, 32767) / 32768.0 * total;
 	for (i = 0; options[i].shape; ++i) {
 		val -= options[i].weight;
 		if (val < 0)
@@ -167,6 +269,20 @@ ExtFunc Shape *ChooseOption(ShapeOption *options)
 	return options[0].shape;
 }
 
+ExtFunc Shape *ChooseShape(ShapeTable *t, RandStream *r)
+{
+	uint64_t bits;
+	int i;
+
+	if (r->legacy)
+		return LegacyChoose(t->options, r);
+	bits = NextRandom(r);
+	i = ((bits >> 32) * t->count) >> 32;
+	if ((bits & 0xffffffff) >= t->keep[i])
+		i = t->alias[i];
+	return t->options[i].shape;
+}
+
 ExtFunc short ShapeToNetNum(Shape *shape)
 {
 	int num;
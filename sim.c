@@ -0,0 +1,239 @@
+/*
+ * Netris -- A free networked version of T*tris
+ * Copyright (C) 1994-2016  Mark H. Weaver et al
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * netris-sim: plays games between copies of the sample robot (sr.c,
+ * built with -DSR_EMBED) as fast as the rules engine will go.  No
+ * screen, no network, no timers; a "tick" is one step of gravity.
+ */
+
+#include "netris.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct _Player {
+	Board board;
+	RandStream rand;		/* Each side picks its own, as in a real match */
+	RobotState robot;		/* And the robot decides for each on its own */
+	int lost;
+	long pieces, lines, junkSent;
+} Player;
+
+static Player players[2];
+static int numPlayers = 1, movesPerTick = 16, verbose, legacy;
+static long maxPieces = 1000;
+
+static void SimUsage(void)
+{
+	fprintf(stderr,
+	  "Usage: netris-sim [-2Lv] [-s seed] [-n games] [-m moves] [-p pieces]\n"
+	  "  -s <seed>\tSeed of the first game (1)\n"
+	  "  -n <games>\tNumber of games to play, one seed each (100)\n"
+	  "  -2\t\tPlay robot against robot instead of robot alone\n"
+	  "  -m <moves>\tRobot commands allowed per tick (16)\n"
+	  "  -p <pieces>\tCall a game over after this many pieces (1000)\n"
+	  "  -L\t\tUse the old 15-bit random number generator\n"
+	  "  -v\t\tPrint a line for every game\n");
+}
+
+static int NewPiece(Player *p)
+{
+	if (!StartNewPiece(&p->board, ChooseShape(&stdTable, &p->rand)))
+		return 0;
+	++p->pieces;
+	RobotNewPiece(&p->robot);
+	return 1;
+}
+
+static void RobotTurn(Player *p)
+{
+	static signed char view[MAX_BOARD_HEIGHT][MAX_BOARD_WIDTH];
+	Board *b = &p->board;
+	char *cmd;
+	int i, y;
+
+	for (i = 0; i < movesPerTick; ++i) {
+		for (y = 0; y < b->visible; ++y)
+			memcpy(view[y], BoardLine(b, y), b->width);
+		if (!(cmd = RobotMove(&p->robot, b->visible, b->width, view)))
+			break;
+		if (!strcmp(cmd, "Rotate")) {
+			if (!RotatePiece(b))
+				break;
+		}
+		else if (!strcmp(cmd, "Left")) {
+			if (!MovePiece(b, 0, -1))
+				break;
+		}
+		else if (!strcmp(cmd, "Right")) {
+			if (!MovePiece(b, 0, 1))
+				break;
+		}
+		else {
+			DropPiece(b);
+			break;
+		}
+	}
+}
+
+/* One tick for player p; returns 0 if p just lost */
+static int Tick(Player *p, Player *opp)
+{
+	int linesCleared, junk;
+
+	if (!MovePiece(&p->board, -1, 0)) {
+		p->lines += linesCleared = LandPiece(&p->board);
+		if (opp && (junk = JunkLines(linesCleared)) > 0) {
+			p->junkSent += junk;
+			InsertJunk(&opp->board, junk,
+				StreamRandom(&opp->rand, 0, opp->board.width));
+		}
+		if (!NewPiece(p))
+			return 0;
+	}
+	RobotTurn(p);
+	return 1;
+}
+
+/* Returns the number of ticks the game lasted */
+static long PlayGame(int seed)
+{
+	long ticks = 0;
+	int scr;
+
+	for (scr = 0; scr < numPlayers; ++scr) {
+		memset(&players[scr], 0, sizeof(players[scr]));
+		SeedStream(&players[scr].rand, seed, legacy);
+		InitBoard(&players[scr].board, NULL, scr);
+		if (!NewPiece(&players[scr]))
+			players[scr].lost = 1;
+	}
+	while (!players[0].lost && (numPlayers < 2 || !players[1].lost)) {
+		for (scr = 0; scr < numPlayers; ++scr)
+			if (!Tick(&players[scr],
+					numPlayers > 1 ? &players[1 - scr] : NULL)) {
+				players[scr].lost = 1;
+				break;
+			}
+		++ticks;
+		if (players[0].pieces >= maxPieces)
+			break;
+	}
+	return ticks;
+}
+
+/*
+ * The robot decides once a piece, when it's all on the board; the one
+ * still falling when the game stopped may not have got that far.
+ */
+static void CheckDecisions(Player *p, int seed, int scr)
+{
+	if (p->robot.decisions <= p->pieces && p->robot.decisions >= p->pieces - 1)
+		return;
+	fprintf(stderr, "netris-sim: seed %d, player %d: %ld decisions for "
+		"%ld pieces\n", seed, scr + 1, p->robot.decisions, p->pieces);
+	exit(1);
+}
+
+static double Seconds(void)
+{
+	return MonoTime() / 1e9;
+}
+
+ExtFunc int main(int argc, char **argv)
+{
+	int firstSeed = 1, games = 100, game, scr, ch;
+	long ticks = 0, pieces = 0, lines = 0, junkSent = 0;
+	long wins[2] = { 0, 0 }, draws = 0, gameTicks;
+	double start, elapsed;
+
+	while ((ch = getopt(argc, argv, "s:n:2m:p:Lvh")) != -1)
+		switch (ch) {
+			case 's':
+				firstSeed = atoi(optarg);
+				break;
+			case 'n':
+				games = atoi(optarg);
+				break;
+			case '2':
+				numPlayers = 2;
+				break;
+			case 'm':
+				movesPerTick = atoi(optarg);
+				break;
+			case 'p':
+				maxPieces = atol(optarg);
+				break;
+			case 'L':
+				legacy = 1;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			case 'h':
+				SimUsage();
+				exit(0);
+			default:
+				SimUsage();
+				exit(1);
+		}
+	if (games < 1 || movesPerTick < 1 || maxPieces < 1) {
+		SimUsage();
+		exit(1);
+	}
+	InitShapes();
+	start = Seconds();
+	for (game = 0; game < games; ++game) {
+		gameTicks = PlayGame(firstSeed + game);
+		ticks += gameTicks;
+		for (scr = 0; scr < numPlayers; ++scr) {
+			pieces += players[scr].pieces;
+			lines += players[scr].lines;
+			junkSent += players[scr].junkSent;
+			CheckDecisions(&players[scr], firstSeed + game, scr);
+		}
+		if (numPlayers < 2 || players[0].lost == players[1].lost)
+			++draws;
+		else
+			++wins[players[0].lost];
+		if (verbose)
+			printf("seed %d: %ld ticks, %ld pieces, %ld lines%s\n",
+				firstSeed + game, gameTicks, players[0].pieces,
+				players[0].lines, numPlayers < 2 ? "" :
+				players[0].lost == players[1].lost ? ", draw" :
+				players[0].lost ? ", player 2 won" : ", player 1 won");
+	}
+	elapsed = Seconds() - start;
+	printf("%d games, %ld ticks, %ld pieces, %ld lines", games, ticks,
+		pieces, lines);
+	if (numPlayers > 1)
+		printf(", %ld junk sent\nplayer 1 won %ld, player 2 won %ld, "
+			"%ld unfinished", junkSent, wins[0], wins[1], draws);
+	printf("\n%.3f seconds, %.1f games/sec, %.0f pieces/sec\n", elapsed,
+		elapsed > 0 ? games / elapsed : 0.0,
+		elapsed > 0 ? pieces / elapsed : 0.0);
+	return 0;
+}
+
+/*
+ * vi: ts=4 ai
+ * vim: noai si
+ */
@@ -25,27 +25,28 @@
 #include <math.h>
 #include <limits.h>
 
+/*
+ * Built with -DSR_EMBED this has no main(), and RobotMove() below lets
+ * a program (netris-sim, for one) use the robot's brain directly.
+ */
+#define ExtFunc		/* Marks functions that need prototypes */
+
 /* Both of these should be at least twice the actual max */
 #define MAX_BOARD_WIDTH		32
 #define MAX_BOARD_HEIGHT	64
 
-char b[1024];
-FILE *logFile;
+static FILE *logFile;
 
-int twoPlayer;
-int boardHeight, boardWidth;
-int board[MAX_BOARD_HEIGHT][MAX_BOARD_WIDTH];
-int piece[4][4];
-int pieceLast[4][4];
+static int boardHeight, boardWidth;
+static int board[MAX_BOARD_HEIGHT][MAX_BOARD_WIDTH];
+static int piece[4][4];
 
-int board1[MAX_BOARD_HEIGHT][MAX_BOARD_WIDTH];
-int piece1[4][4];
-int piece2[4][4];
+static int board1[MAX_BOARD_HEIGHT][MAX_BOARD_WIDTH];
+static int piece1[4][4];
+static int piece2[4][4];
 
-int pieceCount;		/* Serial number of current piece, for sending commands */
-int pieceVisible;	/* How many blocks of the current piece are visible */
-int pieceBottom, pieceLeft;	/* Position of bottom-left square */
-int pieceBottomLast, pieceLeftLast;
+static int pieceVisible;	/* How many blocks of the current piece are visible */
+static int pieceBottom, pieceLeft;	/* Position of bottom-left square */
 
 /*
  * 0 = Not decided yet
@@ -53,35 +54,19 @@ int pieceBottomLast, pieceLeftLast;
  * 2 = move in progress
  * 3 = drop in progress
  */
-int pieceState;
-
-int leftDest;
-int pieceDest[4][4];
+static int pieceState;
 
-int masterEnable = 1, dropEnable = 1;
+static int leftDest;
+static int pieceDest[4][4];
 
-float curTime, moveTimeout;
+static int dropEnable = 1;
 
-int min(int a, int b)
+static int min(int a, int b)
 {
 	return a < b ? a : b;
 }
 
-char *ReadLine(char *buf, int size)
-{
-	int len;
-
-	if (!fgets(buf, size, stdin))
-		return NULL;
-	len = strlen(buf);
-	if (len > 0 && buf[len-1] == '\n')
-		buf[len-1] = 0;
-	if (logFile)
-		fprintf(logFile, "  %s\n", buf);
-	return buf;
-}
-
-int WriteLine(char *fmt, ...)
+static int WriteLine(char *fmt, ...)
 {
 	int result;
 	va_list args;
@@ -96,7 +81,7 @@ int WriteLine(char *fmt, ...)
 	return result;
 }
 
-void FindPiece(void)
+static void FindPiece(void)
 {
 	int row, col;
 
@@ -111,12 +96,16 @@ void FindPiece(void)
 					pieceLeft = col;
 				pieceVisible++;
 			}
+	if (!pieceVisible) {
+		memset(piece, 0, sizeof(piece));
+		return;
+	}
 	for (row = 0; row < 4; ++row)
 		for (col = 0; col < 4; ++col)
 			piece[row][col] = board[pieceBottom + row][pieceLeft + col] < 0;
 }
 
-void RotatePiece1(void)
+static void RotatePiece1(void)
 {
 	int row, col, height = 0;
 
@@ -133,7 +122,7 @@ void RotatePiece1(void)
 			piece1[row][col] = piece2[height - col - 1][row];
 }
 
-int PieceFits(int row, int col)
+static int PieceFits(int row, int col)
 {
 	int i, j;
 
@@ -147,7 +136,29 @@ int PieceFits(int row, int col)
 	return 1;
 }
 
-int SimPlacement(int row, int col)
+/*
+ * Where piece1, fitting at (row, col), lands if dropped.  Straight from
+ * the column heights if it's above them all, else the slow way.
+ */
+static int LandingRow(int *height, int row, int col)
+{
+	int i, j, land = 0;
+
+	for (j = 0; j < 4; ++j)
+		for (i = 0; i < 4; ++i)
+			if (piece1[i][j]) {
+				if (land < height[col + j] - i)
+					land = height[col + j] - i;
+				break;
+			}
+	if (land <= row)
+		return land;
+	while (PieceFits(row - 1, col))
+		--row;
+	return row;
+}
+
+static int SimPlacement(int row, int col)
 {
 	int i, j;
 	int from, to, count;
@@ -168,7 +179,7 @@ int SimPlacement(int row, int col)
 	return from - to;
 }
 
-double BoardScore(int linesCleared, int pRow, int verbose)
+static double BoardScore(int linesCleared, int pRow, int verbose)
 {
 	double score = 0;
 	double avgHeight2 = 0, avgHolesTimesDepth = 0;
@@ -299,37 +310,25 @@ double BoardScore(int linesCleared, int pRow, int verbose)
 	return score;
 }
 
-void PrintGoal(void)
-{
-	char b[32];
-	int i, j, c;
-
-	c = 0;
-	for (i = 0; i < 4; ++i) {
-		b[c++] = ':';
-		for (j = 0; j < 4; ++j)
-			b[c++] = pieceDest[i][j] ? '*' : ' ';
-	}
-	b[c++]=':';
-	b[c++]=0;
-	WriteLine("Message Goal %d %s\n", leftDest, b);
-}
-
-double MakeDecision(void)
+static double MakeDecision(void)
 {
 	int row, col, rot;
 	int linesCleared;
 	int first = 1;
+	int height[MAX_BOARD_WIDTH];
 	double minScore = 0, score;
 
+	for (col = 0; col < boardWidth; ++col)
+		for (height[col] = boardHeight; height[col] > 0
+				&& board[height[col] - 1][col] <= 0; --height[col])
+			;
 	memcpy(piece1, piece, sizeof(piece));
 	for (rot = 0; rot < 4; ++rot) {
 		RotatePiece1();
 		for (col = 0; col < boardWidth; ++col) {
 			if (!PieceFits(pieceBottom, col))
 				continue;
-			for (row = pieceBottom; PieceFits(row-1, col); --row)
-				;
+			row = LandingRow(height, pieceBottom, col);
 			linesCleared = SimPlacement(row, col);
 			score = BoardScore(linesCleared, row, 0);
 			if (first || minScore > score) {
@@ -340,11 +339,143 @@ double MakeDecision(void)
 			}
 		}
 	}
-	PrintGoal();
 	return minScore;
 }
 
-double PeekScore(int verbose)
+/*
+ * Once we've decided, what to do next to get the piece there: the name
+ * of the command to send, or NULL if there's nothing left to do.
+ */
+static char *ChooseMove(void)
+{
+	if (memcmp(piece, pieceDest, sizeof(piece)))
+		return "Rotate";
+	if (pieceLeft != leftDest)
+		return pieceLeft < leftDest ? "Right" : "Left";
+	if (dropEnable)
+		return "Drop";
+	return NULL;
+}
+
+#ifdef SR_EMBED
+
+/* As in netris.h: one board's decision, kept between RobotMove()s */
+typedef struct _RobotState {
+	int pieceState;
+	int leftDest;
+	int pieceDest[4][4];
+	long decisions;
+} RobotState;
+
+/* Forget about the last piece; the next RobotMove() decides afresh */
+ExtFunc void RobotNewPiece(RobotState *rs)
+{
+	rs->pieceState = 0;
+}
+
+/*
+ * blocks[] holds the bottom height lines of the board, as RowUpdate would
+ * send them: the falling piece negative.
+ */
+static void LoadBoard(int height, int width,
+					signed char (*blocks)[MAX_BOARD_WIDTH])
+{
+	int row, col;
+
+	boardHeight = height;
+	boardWidth = width;
+	for (row = 0; row < height; ++row)
+		for (col = 0; col < width; ++col)
+			board[row][col] = blocks[row][col];
+	FindPiece();
+}
+
+/*
+ * Returns the next command, as ChooseMove() does, or NULL if the piece
+ * isn't all on the board yet.  rs is the board's own decision, so any
+ * number of boards can take turns.
+ */
+ExtFunc char *RobotMove(RobotState *rs, int height, int width,
+ExtFunc				signed char (*blocks)[MAX_BOARD_WIDTH])
+{
+	LoadBoard(height, width, blocks);
+	if (pieceVisible < 4)
+		return NULL;
+	if (rs->pieceState == 0) {
+		MakeDecision();
+		rs->leftDest = leftDest;
+		memcpy(rs->pieceDest, pieceDest, sizeof(pieceDest));
+		rs->pieceState = 1;
+		++rs->decisions;
+	}
+	else {
+		leftDest = rs->leftDest;
+		memcpy(pieceDest, rs->pieceDest, sizeof(pieceDest));
+	}
+	return ChooseMove();
+}
+
+/* MakeDecision() and BoardScore() on their own, for netris-bench */
+ExtFunc double RobotDecide(int height, int width,
+ExtFunc				signed char (*blocks)[MAX_BOARD_WIDTH])
+{
+	LoadBoard(height, width, blocks);
+	pieceState = 0;
+	return pieceVisible < 4 ? 0 : MakeDecision();
+}
+
+ExtFunc double RobotScore(int height, int width,
+ExtFunc				signed char (*blocks)[MAX_BOARD_WIDTH])
+{
+	int row, col;
+
+	LoadBoard(height, width, blocks);
+	for (row = 0; row < height; ++row)
+		for (col = 0; col < width; ++col)
+			board1[row][col] = board[row][col] > 0;
+	return BoardScore(0, pieceBottom, 0);
+}
+
+#else
+
+static char b[1024];
+static int pieceLast[4][4];
+static int pieceCount;		/* Serial number of current piece, for commands */
+static int pieceLeftLast;
+static int masterEnable = 1;
+static float curTime, moveTimeout;
+
+static char *ReadLine(char *buf, int size)
+{
+	int len;
+
+	if (!fgets(buf, size, stdin))
+		return NULL;
+	len = strlen(buf);
+	if (len > 0 && buf[len-1] == '\n')
+		buf[len-1] = 0;
+	if (logFile)
+		fprintf(logFile, "  %s\n", buf);
+	return buf;
+}
+
+static void PrintGoal(void)
+{
+	char b[32];
+	int i, j, c;
+
+	c = 0;
+	for (i = 0; i < 4; ++i) {
+		b[c++] = ':';
+		for (j = 0; j < 4; ++j)
+			b[c++] = pieceDest[i][j] ? '*' : ' ';
+	}
+	b[c++]=':';
+	b[c++]=0;
+	WriteLine("Message Goal %d %s\n", leftDest, b);
+}
+
+static double PeekScore(int verbose)
 {
 	int row, col, linesCleared;
 
@@ -360,6 +491,7 @@ int main(int argc, char **argv)
 {
 	int ac;
 	char *av[32];
+	char *cmd;
 
 	if (argc == 2 && !strcmp(argv[1], "-l")) {
 		logFile = fopen("log", "w");
@@ -437,28 +569,19 @@ int main(int argc, char **argv)
 			}
 			if (pieceState == 0) {		/* Undecided */
 				MakeDecision();
+				PrintGoal();
 				pieceState = 1;
 			}
 			if (pieceState >= 2) {		/* Move or drop in progress */
 				if (curTime >= moveTimeout)
 					pieceState = 1;
 			}
-			if (pieceState == 1) {		/* Decided */
-				if (memcmp(piece, pieceDest, sizeof(piece))) {
-					WriteLine("Rotate %d\n", pieceCount);
+			if (pieceState == 1 && (cmd = ChooseMove())) {	/* Decided */
+				WriteLine("%s %d\n", cmd, pieceCount);
+				if (strcmp(cmd, "Drop"))
 					pieceState = 2;
-				}
-				else if (pieceLeft != leftDest) {
-					if (pieceLeft < leftDest)
-						WriteLine("Right %d\n", pieceCount);
-					else
-						WriteLine("Left %d\n", pieceCount);
-					pieceState = 2;
-				}
-				else if (dropEnable) {
-					WriteLine("Drop %d\n", pieceCount);
+				else
 					pieceState = 3;
-				}
 				if (pieceState == 2)
 					moveTimeout = curTime + 0.5;
 			}
@@ -467,6 +590,8 @@ int main(int argc, char **argv)
 	return 0;
 }
 
+#endif /* SR_EMBED */
+
 /*
  * vi: ts=4 ai
  * vim: noai si
@@ -0,0 +1,218 @@
+/*
+ * Netris -- A free networked version of T*tris
+ * Copyright (C) 1994-2016  Mark H. Weaver et al
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include "netris.h"
+#include <string.h>
+#include <time.h>
+
+/*
+ * A hierarchical timer wheel.  Time goes in ticks of TICK_NSEC on the
+ * monotonic clock.  Level 0 has a slot per tick for the WHEEL_SLOTS
+ * ticks around now; each level up has slots WHEEL_SLOTS times as wide.
+ * A timer goes in the lowest level whose window its deadline is in,
+ * and is moved down a level ("cascaded") when time reaches its slot.
+ * Arming and cancelling are O(1), and so is finding the next thing to
+ * do, since each level has a bitmap of the slots in use.  Deadlines
+ * past the top level's reach wait in its last slot and are cascaded
+ * again until they come within it.
+ *
+ * The wheel isn't locked: each thread that wants timers has its own.
+ */
+
+#define LEVEL_SHIFT(level)	(WHEEL_BITS * (level))
+#define SLOT_MASK			(WHEEL_SLOTS - 1)
+
+/*
+ * Nanoseconds on the monotonic clock, which NTP and the like can't set
+ * back or forward.  It's the clock timerfds go by, too.
+ */
+ExtFunc int64_t MonoTime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * (int64_t)1000000000 + ts.tv_nsec;
+}
+
+ExtFunc void InitTimerWheel(TimerWheel *w)
+{
+	memset(w, 0, sizeof(*w));
+	w->now = MonoTime() / TICK_NSEC;
+}
+
+ExtFunc void InitTimer(Timer *t, TimerFunc func, void *data)
+{
+	memset(t, 0, sizeof(*t));
+	t->func = func;
+	t->data = data;
+}
+
+static int FirstBit(uint64_t bits)
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(bits);
+#else
+	int n = 0;
+
+	while (!(bits & 1)) {
+		bits >>= 1;
+		++n;
+	}
+	return n;
+#endif
+}
+
+static void Insert(TimerWheel *w, Timer *t)
+{
+	int64_t when = t->when > w->now ? t->when : w->now;
+	int level, slot;
+
+	/* The first level up whose slots are wider than the gap */
+	for (level = 0; level < WHEEL_LEVELS - 1; ++level)
+		if (when >> LEVEL_SHIFT(level + 1) == w->now >> LEVEL_SHIFT(level + 1))
+			break;
+	if (when >> LEVEL_SHIFT(WHEEL_LEVELS) == w->now >> LEVEL_SHIFT(WHEEL_LEVELS))
+		slot = (when >> LEVEL_SHIFT(level)) & SLOT_MASK;
+	else
+		slot = ((w->now >> LEVEL_SHIFT(level)) - 1) & SLOT_MASK;
+	t->wheel = w;
+	t->level = level;
+	t->slot = slot;
+	if ((t->next = w->slots[level][slot]))
+		t->next->pprev = &t->next;
+	t->pprev = &w->slots[level][slot];
+	*t->pprev = t;
+	w->used[level] |= (uint64_t)1 << slot;
+}
+
+/* Doesn't matter whether it's armed */
+ExtFunc void CancelTimer(Timer *t)
+{
+	TimerWheel *w = t->wheel;
+
+	if (!t->pprev)
+		return;
+	if ((*t->pprev = t->next))
+		t->next->pprev = t->pprev;
+	t->pprev = NULL;
+	if (!w->slots[t->level][t->slot])
+		w->used[t->level] &= ~((uint64_t)1 << t->slot);
+}
+
+/* Arm t to go off at when, by MonoTime */
+ExtFunc void ArmTimer(TimerWheel *w, Timer *t, int64_t when)
+{
+	CancelTimer(t);
+	t->when = (when + TICK_NSEC - 1) / TICK_NSEC;
+	Insert(w, t);
+}
+
+/* Move the timers in a slot to *list, leaving the slot empty */
+static void TakeSlot(TimerWheel *w, int level, int slot, Timer **list)
+{
+	if ((*list = w->slots[level][slot]))
+		(*list)->pprev = list;
+	w->slots[level][slot] = NULL;
+	w->used[level] &= ~((uint64_t)1 << slot);
+}
+
+/* The first tick from now that has timers due or a slot to cascade */
+static int64_t NextTick(TimerWheel *w)
+{
+	int64_t next = -1, tick;
+	uint64_t used;
+	int level, cur;
+
+	for (level = 0; level < WHEEL_LEVELS; ++level) {
+		if (!(used = w->used[level]))
+			continue;
+		cur = (w->now >> LEVEL_SHIFT(level)) & SLOT_MASK;
+		if (cur)
+			used = (used >> cur) | (used << (WHEEL_SLOTS - cur));
+		tick = ((w->now >> LEVEL_SHIFT(level)) + FirstBit(used))
+			<< LEVEL_SHIFT(level);
+		if (tick < w->now)
+			tick = w->now;
+		if (next < 0 || tick < next)
+			next = tick;
+	}
+	return next;
+}
+
+/* Move the slots whose time has come down to the levels below */
+static void Cascade(TimerWheel *w)
+{
+	Timer *list, *t;
+	int level;
+
+	for (level = 1; level < WHEEL_LEVELS; ++level) {
+		if (w->now & (((int64_t)1 << LEVEL_SHIFT(level)) - 1))
+			break;
+		TakeSlot(w, level, (w->now >> LEVEL_SHIFT(level)) & SLOT_MASK,
+			&list);
+		while ((t = list)) {
+			list = t->next;
+			Insert(w, t);
+		}
+	}
+}
+
+/*
+ * Call the functions of the timers due by now.  They may arm and
+ * cancel timers, even their own; one armed for now or earlier goes
+ * off a tick later.  Returns how many went off.
+ */
+ExtFunc int RunTimers(TimerWheel *w, int64_t now)
+{
+	int64_t tick, target = now / TICK_NSEC;
+	Timer *list, *t;
+	int count = 0;
+
+	while ((tick = NextTick(w)) >= 0 && tick <= target) {
+		w->now = tick;
+		Cascade(w);
+		TakeSlot(w, 0, tick & SLOT_MASK, &list);
+		w->now = tick + 1;
+		while ((t = list)) {
+			CancelTimer(t);
+			t->func(t);
+			++count;
+		}
+	}
+	if (w->now <= target)
+		w->now = target + 1;
+	return count;
+}
+
+/* Milliseconds until RunTimers has something to do, or -1 for never */
+ExtFunc int NextTimeout(TimerWheel *w, int64_t now)
+{
+	int64_t tick = NextTick(w);
+
+	if (tick < 0)
+		return -1;
+	tick = tick * TICK_NSEC - now;
+	return tick > 0 ? (tick + 999999) / 1000000 : 0;
+}
+
+/*
+ * vi: ts=4 ai
+ * vim: noai si
+ */
@@ -28,16 +28,54 @@
 #include <sys/time.h>
 #include <netdb.h>
 #include <errno.h>
+#ifdef HAS_EPOLL
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+#ifdef HAS_TIMERFD
+#include <sys/timerfd.h>
+#include <stdint.h>
+#endif
 
 static MyEventType AlarmGenFunc(EventGenRec *gen, MyEvent *event);
+static void WatchEventGen(EventGenRec *gen);
 
 static EventGenRec alarmGen =
 		{ &alarmGen, 0, FT_read, -1, AlarmGenFunc, EM_alarm };
 static EventGenRec *nextGen = &alarmGen;
 
-static int myRandSeed = 1;
+/*
+ * The generators' fds are registered with the kernel once, by
+ * AddEventGen, and stay registered until RemoveEventGen: with epoll
+ * where we have it, or else in a pollfd array that's only rebuilt when
+ * something changes.  A generator outside the mask WaitMyEvent was
+ * last given has its interest turned off, so its fd can't keep waking
+ * us up for nothing.
+ */
+#define MAX_GENS	16
+
+static int waitMask = EM_any;
+#ifdef HAS_EPOLL
+static int epfd = -1;
+#else
+static struct pollfd pollFds[MAX_GENS];
+static EventGenRec *pollGens[MAX_GENS];
+static int numPollFds, pollDirty = 1;
+#endif
 
-static struct timeval baseTimeval;
+/*
+ * The game's clock, in nanoseconds by MonoTime.  WaitMyEvent reads it
+ * once each time around, and everything until the next reading goes
+ * by that: timers, timestamps, gravity's lateness.
+ */
+static int64_t clockNow, baseTime;
+
+/* When the next gravity tick is due, and how often they come */
+static int64_t alarmDue, alarmInterval;
+
+/* Deadlines for anything in the game; they go off in WaitMyEvent */
+static TimerWheel timers;
 
 ExtFunc void InitUtil(void)
 {
@@ -46,12 +84,32 @@ ExtFunc void InitUtil(void)
 	else
 		SRandom(time(0));
 	signal(SIGINT, CatchInt);
+	InitTimerWheel(&timers);
+#ifdef HAS_TIMERFD
+	alarmGen.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (alarmGen.fd < 0)
+		die("timerfd_create");
+	WatchEventGen(&alarmGen);
+#endif
 	ResetBaseTime();
 }
 
+/* Start a game's clock, and its lateness figures */
 ExtFunc void ResetBaseTime(void)
 {
-	gettimeofday(&baseTimeval, NULL);
+	baseTime = clockNow = MonoTime();
+	memset(&lateness, 0, sizeof(lateness));
+}
+
+ExtFunc int64_t GameClock(void)
+{
+	return clockNow;
+}
+
+/* Arm t to go off usec from now */
+ExtFunc void StartTimer(Timer *t, long usec)
+{
+	ArmTimer(&timers, t, clockNow + usec * (int64_t)1000);
 }
 
 ExtFunc void AtExit(void (*handler)(void))
@@ -78,12 +136,16 @@ ExtFunc void Usage(void)
 	  "  -h		Print usage information\n"
 	  "  -w		Wait for connection\n"
 	  "  -c <host>	Initiate connection\n"
+	  "  -V <match>	Watch a match (0 for the newest) on the netrisd\n"
+	  "		  given with -c; the port defaults to %d\n"
 	  "  -p <port>	Set port number (default is %d)\n"
 	  "  -k <keys>	Remap keys.  The argument is a prefix of the string\n"
 	  "	  	containing the keys in order: left, full left, rotate, right, \n"
 	  "		full right, drop, down-faster, toggle-spying, pause, faster, "
 	  "redraw, new.\n 		\"^\" prefixes controls.  (default is \"%s\")\n"
 	  "  -i <sec>	Set the step-down interval, in seconds\n"
+	  "  -f <fps>	Draw at most this many frames a second, though your\n"
+	  "		  own keys always show at once; 0 for no limit (%d)\n"
 	  "  -r <robot>	Execute <robot> (a command) as a robot controlling\n"
 	  "		  the game instead of the keyboard\n"
 	  "  -F		Use fair robot interface\n"
@@ -93,9 +155,12 @@ ExtFunc void Usage(void)
 	  "		  another drop automatically\n"
 	  "  -S		Disable inverse/bold/color for slow terminals\n"
 	  "  -C		Disable color\n"
+	  "  -A		Draw with ANSI escape codes instead of curses, which\n"
+	  "		  sends less over slow links\n"
 	  "  -H		Show distribution and warranty information\n"
 	  "  -R		Show rules\n",
-	  version_string, DEFAULT_PORT, DEFAULT_KEYS);
+	  version_string, DEFAULT_WATCH_PORT, DEFAULT_PORT, DEFAULT_KEYS,
+	  DEFAULT_FRAME_RATE);
 }
 
 ExtFunc void DistInfo(void)
@@ -154,20 +219,10 @@ ExtFunc void Rules(void)
 	  version_string);
 }
 
-/*
- * My really crappy random number generator follows
- * Should be more than sufficient for our purposes though
- */
 ExtFunc void SRandom(int seed)
 {
 	initSeed = seed;
-	myRandSeed = seed % 31751 + 1;
-}
-
-ExtFunc int Random(int min, int max1)
-{
-	myRandSeed = (myRandSeed * 31751 + 15437) % 32767;
-	return myRandSeed % (max1 - min) + min;
+	SeedRandom(seed);
 }
 
 ExtFunc int MyRead(int fd, void *data, int len)
@@ -219,42 +274,87 @@ ExtFunc void CatchInt(int sig)
 	exit(0);
 }
 
-ExtFunc void CatchAlarm(int sig)
+/*
+ * A gravity tick due at alarmDue is being handled now.  Any that came
+ * due while we were busy only make this one event, so they're missed.
+ */
+static void NoteAlarm(void)
 {
-	alarmGen.ready = 1;
-	signal(SIGALRM, CatchAlarm);
+	int64_t late;
+	long missed = 0;
+
+	if (!alarmDue)
+		return;
+	late = clockNow > alarmDue ? clockNow - alarmDue : 0;
+	if (alarmInterval > 0) {
+		missed = late / alarmInterval;
+		late -= missed * alarmInterval;
+		alarmDue += (missed + 1) * alarmInterval;
+	}
+	else
+		alarmDue = 0;
+	++lateness.ticks;
+	lateness.missed += missed;
+	lateness.total += late;
+	if (late > lateness.worst)
+		lateness.worst = late;
 }
 
+/*
+ * The gravity clock.  With timerfd it's an fd like any other event
+ * generator's, so it needs no signals, and there could be any number
+ * of them.  Otherwise it's setitimer, and SIGALRM sets alarmGen.ready.
+ */
+#ifdef HAS_TIMERFD
+
 static MyEventType AlarmGenFunc(EventGenRec *gen, MyEvent *event)
 {
+	uint64_t expirations;
+
+	/* Several ticks we were too busy for still make one event */
+	if (read(gen->fd, &expirations, sizeof(expirations)) < 0)
+		return E_none;
+	NoteAlarm();
 	return E_alarm;
 }
 
-ExtFunc long CurTimeval(void)
+static void SetTimespec(struct timespec *ts, int64_t nsec)
 {
-	struct timeval tv;
-
-	gettimeofday(&tv, NULL);
-	tv.tv_sec -= baseTimeval.tv_sec;
-	tv.tv_usec -= baseTimeval.tv_usec;
-	return GetTimeval(&tv);
+	ts->tv_sec = nsec / 1000000000;
+	ts->tv_nsec = nsec % 1000000000;
 }
 
-ExtFunc void SetTimeval(struct timeval *tv, long usec)
+/*
+ * The first tick is set for value after the clock's last reading, not
+ * after whenever this is called.  Resetting the timer also throws away
+ * ticks we haven't read.
+ */
+ExtFunc long SetITimer(long interval, long value)
 {
-	tv->tv_sec = usec / 1000000;
-	tv->tv_usec = usec % 1000000;
+	struct itimerspec it, old;
+
+	alarmInterval = interval * (int64_t)1000;
+	alarmDue = value ? clockNow + value * (int64_t)1000 : 0;
+	SetTimespec(&it.it_interval, alarmInterval);
+	SetTimespec(&it.it_value, alarmDue);
+	if (timerfd_settime(alarmGen.fd, TFD_TIMER_ABSTIME, &it, &old) < 0)
+		die("timerfd_settime");
+	alarmGen.ready = 0;
+	return old.it_value.tv_sec * 1000000 + old.it_value.tv_nsec / 1000;
 }
 
-ExtFunc long GetTimeval(struct timeval *tv)
+#else /* HAS_TIMERFD */
+
+ExtFunc void CatchAlarm(int sig)
 {
-	return tv->tv_sec * 1000000 + tv->tv_usec;
+	alarmGen.ready = 1;
+	signal(SIGALRM, CatchAlarm);
 }
 
-ExtFunc void die(char *msg)
+static MyEventType AlarmGenFunc(EventGenRec *gen, MyEvent *event)
 {
-	perror(msg);
-	exit(1);
+	NoteAlarm();
+	return E_alarm;
 }
 
 static long SetITimer1(long interval, long value)
@@ -275,10 +375,37 @@ ExtFunc long SetITimer(long interval, long value)
 
 	old = SetITimer1(0, 0);
 	alarmGen.ready = 0;
+	alarmInterval = interval * (int64_t)1000;
+	alarmDue = value ? clockNow + value * (int64_t)1000 : 0;
 	SetITimer1(interval, value);
 	return old;
 }
 
+#endif /* HAS_TIMERFD */
+
+/* Microseconds since the game started, as of the clock's last reading */
+ExtFunc long CurTimeval(void)
+{
+	return (clockNow - baseTime) / 1000;
+}
+
+ExtFunc void SetTimeval(struct timeval *tv, long usec)
+{
+	tv->tv_sec = usec / 1000000;
+	tv->tv_usec = usec % 1000000;
+}
+
+ExtFunc long GetTimeval(struct timeval *tv)
+{
+	return tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+ExtFunc void die(char *msg)
+{
+	perror(msg);
+	exit(1);
+}
+
 ExtFunc void fatal(char *msg)
 {
 	CleanupScreens ();
@@ -325,11 +452,145 @@ ExtFunc void RestoreSignals(MySigSet *saved, MySigSet *set)
 #endif
 }
 
+#ifdef HAS_EPOLL
+
+static void InitWait(void)
+{
+	if (epfd < 0 && (epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		die("epoll_create1");
+}
+
+/* Tell the kernel what gen's fd should wake us for, under waitMask */
+static void ArmEventGen(EventGenRec *gen, int op)
+{
+	static int fdEvents[FT_len] = { EPOLLIN, EPOLLOUT, EPOLLPRI };
+	struct epoll_event ev;
+
+	ev.events = (gen->mask & waitMask) ? fdEvents[gen->fdType] : 0;
+	ev.data.ptr = gen;
+	if (epoll_ctl(epfd, op, gen->fd, &ev) < 0) {
+		/* A plain file is always readable, and epoll won't have it */
+		if (errno != EPERM)
+			die("epoll_ctl");
+		gen->armed = -1;
+		gen->ready = 1;
+	}
+	else
+		gen->armed = ev.events;
+}
+
+static void WatchEventGen(EventGenRec *gen)
+{
+	InitWait();
+	ArmEventGen(gen, EPOLL_CTL_ADD);
+}
+
+static void RewatchEventGen(EventGenRec *gen)
+{
+	ArmEventGen(gen, EPOLL_CTL_MOD);
+}
+
+/* If the fd has been closed already, that did this for us */
+static void ForgetEventGen(EventGenRec *gen)
+{
+	if (gen->armed >= 0)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, gen->fd, NULL);
+}
+
+/*
+ * Returns with the ready flag set on every generator that has input,
+ * or after timeout milliseconds if that isn't -1.  If unblocked isn't
+ * NULL, that's the signal mask to wait with.
+ */
+static void WaitFds(MySigSet *unblocked, int timeout)
+{
+	struct epoll_event events[MAX_GENS];
+	int n, i;
+
+	if (!unblocked)
+		n = epoll_wait(epfd, events, MAX_GENS, timeout);
+	else {
+#ifdef HAS_SIGPROCMASK
+		n = epoll_pwait(epfd, events, MAX_GENS, timeout, unblocked);
+#else
+		MySigSet blocked;
+
+		RestoreSignals(&blocked, unblocked);
+		n = epoll_wait(epfd, events, MAX_GENS, timeout);
+		RestoreSignals(NULL, &blocked);
+#endif
+	}
+	if (n < 0 && errno != EINTR)
+		die("epoll_wait");
+	for (i = 0; i < n; ++i)
+		((EventGenRec *)events[i].data.ptr)->ready = 1;
+}
+
+#else /* HAS_EPOLL */
+
+static void InitWait(void)
+{
+}
+
+static void WatchEventGen(EventGenRec *gen)
+{
+	gen->armed = (gen->mask & waitMask) != 0;
+	pollDirty = 1;
+}
+
+static void RewatchEventGen(EventGenRec *gen)
+{
+	gen->armed = (gen->mask & waitMask) != 0;
+	pollDirty = 1;
+}
+
+static void ForgetEventGen(EventGenRec *gen)
+{
+	pollDirty = 1;
+}
+
+static void WaitFds(MySigSet *unblocked, int timeout)
+{
+	static int fdEvents[FT_len] = { POLLIN, POLLOUT, POLLPRI };
+	MySigSet blocked;
+	EventGenRec *gen;
+	int n, i;
+
+	if (pollDirty) {
+		numPollFds = 0;
+		gen = nextGen;
+		do {
+			if (gen->fd >= 0 && (gen->mask & waitMask)
+					&& numPollFds < MAX_GENS) {
+				pollFds[numPollFds].fd = gen->fd;
+				pollFds[numPollFds].events = fdEvents[gen->fdType];
+				pollGens[numPollFds++] = gen;
+			}
+			gen = gen->next;
+		} while (gen != nextGen);
+		pollDirty = 0;
+	}
+	if (unblocked)
+		RestoreSignals(&blocked, unblocked);
+	n = poll(pollFds, numPollFds, timeout);
+	if (unblocked)
+		RestoreSignals(NULL, &blocked);
+	if (n < 0 && errno != EINTR)
+		die("poll");
+	for (i = 0; n > 0 && i < numPollFds; ++i)
+		if (pollFds[i].revents)
+			pollGens[i]->ready = 1;
+}
+
+#endif /* HAS_EPOLL */
+
 ExtFunc void AddEventGen(EventGenRec *gen)
 {
 	assert(gen->next == NULL);
 	gen->next = nextGen->next;
 	nextGen->next = gen;
+	if (gen->fd >= 0)
+		WatchEventGen(gen);
 }
 
 ExtFunc void RemoveEventGen(EventGenRec *gen)
@@ -340,60 +601,69 @@ ExtFunc void RemoveEventGen(EventGenRec *gen)
 			nextGen = nextGen->next;
 		nextGen->next = gen->next;
 		gen->next = NULL;
+		if (gen->fd >= 0)
+			ForgetEventGen(gen);
 	}
 }
 
+/* Turn interest on or off for the generators a new mask lets in or out */
+static void SetWaitMask(int mask)
+{
+	EventGenRec *gen;
+
+	waitMask = mask;
+	gen = nextGen;
+	do {
+		if (gen->fd >= 0 && gen->armed >= 0
+				&& !(gen->mask & mask) != !gen->armed)
+			RewatchEventGen(gen);
+		gen = gen->next;
+	} while (gen != nextGen);
+}
+
+/*
+ * Hand out an event from the first generator in the mask that has one,
+ * taking them in turn.  When none has, wait for one of their fds, or
+ * for the next timer.  Timers go off whatever the mask; what they do
+ * is up to them, such as setting some generator's ready flag.
+ * Without timerfd, SIGALRM sets alarmGen.ready, so it's held off until
+ * we're waiting; it can't slip in between our look at the flags and
+ * the wait.  (The robot's SIGPIPE needn't be: its pipe wakes us too.)
+ */
 ExtFunc MyEventType WaitMyEvent(MyEvent *event, int mask)
 {
-	int i, retry = 0;
-	fd_set fds[FT_len];
 	EventGenRec *gen;
-	int result, anyReady, anySet;
-	struct timeval tv;
+	MySigSet *unblocked = NULL;
+#ifndef HAS_TIMERFD
+	MySigSet saved;
+#endif
 
-	/* XXX In certain circumstances, this routine does polling */
+	FlushNet();		/* Whatever we sent since last time, in one write */
+	InitWait();
+	if (mask != waitMask)
+		SetWaitMask(mask);
+#ifndef HAS_TIMERFD
+	BlockSignals(&saved, SIGALRM, 0);
+	unblocked = &saved;
+#endif
 	for (;;) {
-		for (i = 0; i < FT_len; ++i)
-			FD_ZERO(&fds[i]);
-		anyReady = anySet = 0;
-		gen = nextGen;
-		do {
-			if (gen->mask & mask) {
-				if (gen->ready)
-					anyReady = 1;
-				if (gen->fd >= 0) {
-					FD_SET(gen->fd, &fds[gen->fdType]);
-					anySet = 1;
-				}
-			}
-			gen = gen->next;
-		} while (gen != nextGen);
-		if (anySet) {
-			tv.tv_sec = 0;
-			tv.tv_usec = (retry && !anyReady) ? 500000 : 0;
-			result = select(FD_SETSIZE, &fds[FT_read], &fds[FT_write],
-					&fds[FT_except], anyReady ? &tv : NULL);
-		}
-		else {
-			if (retry && !anyReady)
-				sleep(1);
-			result = 0;
-		}
+		clockNow = MonoTime();
+		RunTimers(&timers, clockNow);
 		gen = nextGen;
 		do {
-			if ((gen->mask & mask)
-					&& (gen->ready || (result > 0 && gen->fd >= 0
-						&& FD_ISSET(gen->fd, &fds[gen->fdType])))) {
-				gen->ready = 0;
+			if ((gen->mask & mask) && gen->ready) {
+				gen->ready = gen->armed < 0;
 				event->type = gen->func(gen, event);
 				if (event->type != E_none) {
 					nextGen = gen->next;
+					if (unblocked)
+						RestoreSignals(NULL, unblocked);
 					return event->type;
 				}
 			}
 			gen = gen->next;
 		} while (gen != nextGen);
-		retry = 1;
+		WaitFds(unblocked, NextTimeout(&timers, clockNow));
 	}
 }
 